@@ -14,7 +14,12 @@
 
 #include <avr/io.h>
 #include <util/delay.h>
+#include <util/atomic.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <string.h>
 
 // Echo RX directly to TX
 //#define DEBUG_ECHO
@@ -22,6 +27,65 @@
 // Blink led when data is received
 #define DEBUG_LED
 
+// Measure loop iteration time and count lost timer ticks,
+// report is sent out on the debug pin, see timingOutput()
+//#define DEBUG_TIMING
+
+// Record received bytes, matched queries, replies and errors with time
+// stamps to a ring in SRAM, sent out on TX after a reset to DEAD mode,
+// see traceDump()
+//#define DEBUG_TRACE
+
+// Store the unknown queries and how many times each was seen to EEPROM,
+// read out with learn-read.py, see learnTask()
+//#define LEARN
+
+// Load the query table from EEPROM at boot if there is a valid one,
+// written with gen-queries.py, see tableLoad()
+//#define EEPROM_TABLE
+
+// Count receive errors, dropped and matched queries, the counts are
+// sent as a reply to the diagnostic query, see diagQuery
+#define COUNTERS
+
+// Paint the unused SRAM at boot and track how deep the stack has gone,
+// the free bytes below it are sent with the counters (needs COUNTERS),
+// see stackCheck()
+//#define STACK_CHECK
+
+// In 3-wire mode, output the lamp power as PWM on ID0 (PB3) for an
+// external light source: off, dimmed or full, and in between when DIM
+// is pulsed. ID0 must be open, see flagPwmUpdate()
+//#define FLAG_PWM
+
+// Host simulation build (sim/) runs the timer while firmware waits for it,
+// and measures the boot time up to the point where RX is listened to.
+// It also sees the trace records, without DEBUG_TRACE too.
+#ifndef SIM_WAIT
+#define SIM_WAIT()
+#endif
+#ifndef SIM_READY
+#define SIM_READY()
+#endif
+#ifndef SIM_TRACE
+#define SIM_TRACE(type, data)	do {} while(0)
+#endif
+
+// Without straps (Ushio), detect the serial protocol from the bit
+// rate of the first received frames: 2400 baud Ushio, 9600 baud Osram
+//#define AUTO_SERIAL
+
+// Use the USI hardware to shift the Ushio serial bits instead of the
+// software UART. USI is clocked by timer 0 and is half-duplex only
+//#define USI_UART
+
+// Software UART ticks per bit at 2400 baud, 8 (default 4). Each bit is
+// then decided by majority of three samples around its center, which
+// rejects spikes shorter than a tick. The 52 us tick has room for LEARN
+// too. 9600 baud always runs at 4 ticks per bit and 16 is not allowed:
+// a 26 us tick is the shortest that fits the loop, see serialLoop().
+//#define UART_OVERSAMPLE	8
+
 
 /**
  * Attiny85 programming pins
@@ -53,320 +117,2020 @@
 #define PULLUPS		(RXPIN | SYNCPIN | ID0 | ID1)
 
 // Timer tick indicator to set operation speed correctly
-volatile uint8_t timerTriggered = 0;
+// Compare A is the main tick, compare B is the software UART RX tick
+// which is phased to the received start bit
+// Flags are kept in GPIOR0, which is in the bit addressable I/O space
+#define TICK_TX_BIT	0
+#define TICK_RX_BIT	1
+#define TICK_TX		(1 << TICK_TX_BIT)
+#define TICK_RX		(1 << TICK_RX_BIT)
+#define timerTriggered	GPIOR0
 
 // Mode, set by the ID bits
+// Building with -DMODE=USHIO, OSRAM or FLAG fixes the mode at compile
+// time instead: straps are not read and the other modes are left out
 typedef enum {DEAD = 0x00, FLAG = 0x01, OSRAM = 0x02, USHIO = 0x03} mode_t;
+#ifdef MODE
+static const mode_t operationMode = MODE;
+#undef AUTO_SERIAL		// Protocol is fixed too
+#else
+mode_t operationMode = DEAD;
+#endif
 
 typedef enum {IDLE, START, DATA, PARITY, STOP} uartState_t;
 
+// Serial speeds
+#define USHIO_BAUD		2400
+#define OSRAM_BAUD		9600
+
+// Timer 1 runs at CLK / 8 = 1 MHz and ticks 4 (or more) times per bit
+// 2400 baud: 104 us tick (+0.2 %), 9600 baud: 26 us tick (+0.2 %)
+#define TICK_COUNTS(baud, ticks)	((uint8_t)(F_CPU / 8 / (ticks) / (baud) + 0.5))
+
+// Ticks per bit
+#if defined(UART_OVERSAMPLE) && UART_OVERSAMPLE != 8
+#error "UART_OVERSAMPLE must be 8, see serialLoop() for the loop budget"
+#endif
+#if defined(UART_OVERSAMPLE) && !defined(USI_UART)
+#define USHIO_TICKS		UART_OVERSAMPLE
+#else
+#define USHIO_TICKS		4
+#endif
+#define OSRAM_TICKS		4
+
+// Majority of three samples, bit n is set if n has two or more bits set
+#define RX_MAJORITY		0xE8
+
+// Time for the pull-ups to settle before the straps are read, us
+#define PULLUP_SETTLE_US	20
+
 // Timeout if complete command is not received
-#define UART_RX_TIMEOUT		480			// 480 cycles @  4x2400 baud = 50 ms
+#define UART_RX_TIMEOUT(baud, ticks)	((uint16_t)(50e-3 * (ticks) * (baud)))	// 50 ms, 480 ticks @ 4x2400 baud
+
+// Incomplete command is also dropped if the next byte does not follow
+// within one character time, 2 x 11 bits from the previous byte
+#define UART_RX_GAP(ticks)	(2 * 11 * (ticks))
+
+// Queries from projector to ballast, and replies to those
+// The tables are in ushio-queries.txt and osram-queries.txt, gen-queries.py
+// compiles them to prefix automatons which are advanced once per received byte
+#define MATCH_NO_QUERY		0xFF	// State does not complete a query
+#define MATCH_DISCARD		0xFF	// Matcher state for unknown query
+#define MATCH_NO_TERMINATOR	0x100	// Queries do not end with a common byte
+#include "ushio-queries.h"
+#include "osram-queries.h"
+
+// Tables are in flash, states are byte offsets in the matcher table
+// Replies are already encoded as serial frames, see TX frame below
+// Reply delays are in 1/4 bits from the end of the query
+const uint8_t ushioMatcher[USHIO_MATCHER_SIZE] PROGMEM = USHIO_MATCHER_DATA;
+const uint16_t ushioReply[USHIO_REPLY_SIZE] PROGMEM = USHIO_REPLY_DATA;
+const uint8_t ushioReplyIndex[USHIO_QUERIES + 1] PROGMEM = USHIO_REPLY_INDEX;
+const uint16_t ushioReplyDelay[USHIO_QUERIES + 1] PROGMEM = USHIO_REPLY_DELAY;
+
+const uint8_t osramMatcher[OSRAM_MATCHER_SIZE] PROGMEM = OSRAM_MATCHER_DATA;
+const uint16_t osramReply[OSRAM_REPLY_SIZE] PROGMEM = OSRAM_REPLY_DATA;
+const uint8_t osramReplyIndex[OSRAM_QUERIES + 1] PROGMEM = OSRAM_REPLY_INDEX;
+const uint16_t osramReplyDelay[OSRAM_QUERIES + 1] PROGMEM = OSRAM_REPLY_DELAY;
+
+// First byte of a query is looked up from a 256 byte table instead of
+// the transitions of the root state, empty tables have none
+#ifdef USHIO_DISPATCH_DATA
+const uint8_t ushioDispatch[256] PROGMEM = USHIO_DISPATCH_DATA;
+#define USHIO_DISPATCH		ushioDispatch
+#else
+#define USHIO_DISPATCH		0
+#endif
+#ifdef OSRAM_DISPATCH_DATA
+const uint8_t osramDispatch[256] PROGMEM = OSRAM_DISPATCH_DATA;
+#define OSRAM_DISPATCH		osramDispatch
+#else
+#define OSRAM_DISPATCH		0
+#endif
 
-// Queries from projector to USHIO ballast, and replies to those
-#define USHIO_MAX_COMMAND 	5
-#define USHIO_QUERIES		5
+// Serial protocol, the UART core and matcher are shared by Ushio and Osram
 typedef struct {
-	unsigned char qLength;		// Query length
-	unsigned char qData[USHIO_MAX_COMMAND];	// Query data
-	unsigned char rLength;		// Reply length
-	unsigned char rData[USHIO_MAX_COMMAND];	// Reply data
-} ushioQuery_t;
-ushioQuery_t ushioQuery[USHIO_QUERIES] = {
-	{2, "\x51\x0D", 3, "\x51\x32\x0D"},
-	{3, "\x4C\x46\x0D", 2, "\x41\x0D"},
-	{2, "\x50\x0D", 3, "\x50\x46\x0D"},
-	{2, "\x51\x0D", 3, "\x51\x32\x0D"},
-	{3, "\x4C\x45\x0D", 2, "\x41\x0D"},	// TODO: This is probably wrong reply!
+	const uint8_t *matcher;		// Matcher states
+	const uint8_t *dispatch;	// Next state for the first byte, always in flash, 0 = none
+	const uint16_t *reply;		// Reply frames
+	const uint8_t *replyIndex;	// Start of each reply
+	const uint16_t *replyDelay;	// Delay of each reply, 1/4 bits
+	uint8_t maxQuery;		// Longest query
+	uint16_t terminator;		// Last byte of every query, ends unknown queries
+	uint16_t timeout;		// Incomplete query timeout, ticks
+	uint16_t gap;			// Longest gap between the bytes of a query, ticks
+	uint8_t bitTicks;		// Ticks per bit
+	mode_t mode;
+	uint8_t queries;		// Table sizes
+	uint8_t matcherSize;
+	uint8_t replySize;
+} serialProtocol_t;
+
+const serialProtocol_t ushioProtocol PROGMEM = {
+	ushioMatcher, USHIO_DISPATCH, ushioReply, ushioReplyIndex, ushioReplyDelay, USHIO_MAX_QUERY, USHIO_TERMINATOR,
+	UART_RX_TIMEOUT(USHIO_BAUD, USHIO_TICKS), UART_RX_GAP(USHIO_TICKS), USHIO_TICKS,
+	USHIO, USHIO_QUERIES, USHIO_MATCHER_SIZE, USHIO_REPLY_SIZE
+	};
+const serialProtocol_t osramProtocol PROGMEM = {
+	osramMatcher, OSRAM_DISPATCH, osramReply, osramReplyIndex, osramReplyDelay, OSRAM_MAX_QUERY, OSRAM_TERMINATOR,
+	UART_RX_TIMEOUT(OSRAM_BAUD, OSRAM_TICKS), UART_RX_GAP(OSRAM_TICKS), OSRAM_TICKS,
+	OSRAM, OSRAM_QUERIES, OSRAM_MATCHER_SIZE, OSRAM_REPLY_SIZE
 	};
 
+#ifdef EEPROM_TABLE
+/**
+ * Query table in EEPROM
+ *
+ * gen-queries.py writes the table of one protocol as an EEPROM image at
+ * the end of EEPROM, where the variables do not reach. Format, 16 bit
+ * values LSB first:
+ *   0   "QT"
+ *   2   mode (USHIO or OSRAM), longest query, terminator (16 bits),
+ *       queries, matcher bytes, reply frames
+ *   9   matcher, reply index (queries + 1 bytes), reply frames,
+ *       reply delays (queries words)
+ *   end checksum, all bytes sum to 0
+ *
+ * At boot the table of the mode, from EEPROM if valid and from flash
+ * otherwise, is copied to SRAM and the matcher reads it from there.
+ * Writing only the EEPROM (avrdude -U eeprom:w:...) changes the table
+ * without reflashing, keep the EESAVE fuse programmed so that the
+ * table survives firmware updates.
+ */
+#define TABLE_SIZE		128	// Bytes of EEPROM for the table
+#define TABLE_ADDRESS		(E2END + 1 - TABLE_SIZE)
+#define TABLE_HEADER		9
+#define TABLE_MAX_QUERIES	16	// Query hits are counted for this many
+uint8_t tableRam[TABLE_SIZE - TABLE_HEADER - 1];
+
+#if USHIO_MATCHER_SIZE + 3 * USHIO_QUERIES + 1 + 2 * USHIO_REPLY_SIZE > TABLE_SIZE - TABLE_HEADER - 1 || \
+    OSRAM_MATCHER_SIZE + 3 * OSRAM_QUERIES + 1 + 2 * OSRAM_REPLY_SIZE > TABLE_SIZE - TABLE_HEADER - 1 || \
+    USHIO_QUERIES > TABLE_MAX_QUERIES || OSRAM_QUERIES > TABLE_MAX_QUERIES
+#error "Built in query table does not fit TABLE_SIZE"
+#endif
+
+#define TABLE_BYTE(address)	(*(address))
+#define TABLE_WORD(address)	(*(address))
+#else
+#define TABLE_BYTE(address)	pgm_read_byte(address)
+#define TABLE_WORD(address)	pgm_read_word(address)
+#endif
+
+// First byte of the diagnostic query, see counters below
+#define DIAG_START		0x7E
+
+#ifdef COUNTERS
+/**
+ * Link counters
+ *
+ * 16 bit counters that stop at the maximum, cleared at reset. Each is
+ * incremented by only one of the interrupt or the main loop. With
+ * STACK_CHECK, COUNT_STACK_FREE is not a count but the stack margin.
+ *
+ * Diagnostic query 0x7E 0x44 0x0D ("~D\r") is answered in both serial
+ * modes with 0x7E, number of counters, the counters LSB first and 0x0D.
+ * Counter order is below, query hits are in the order of the queries in
+ * the table. No query in the tables may start with 0x7E, gen-queries.py
+ * and tableLoad() reject such a table.
+ */
+#if defined(EEPROM_TABLE)
+#define COUNT_QUERIES		TABLE_MAX_QUERIES
+#elif USHIO_QUERIES > OSRAM_QUERIES
+#define COUNT_QUERIES		USHIO_QUERIES
+#else
+#define COUNT_QUERIES		OSRAM_QUERIES
+#endif
+
+enum {
+	COUNT_PARITY,		// Bytes with parity error
+	COUNT_FRAMING,		// Bytes without stop bit
+	COUNT_RX_OVERFLOW,	// Bytes lost, receive buffer full
+	COUNT_TX_FULL,		// Replies that waited for room in the transmit buffer
+	COUNT_TIMEOUT,		// Incomplete queries dropped after timeout or gap
+	COUNT_UNKNOWN,		// Unknown queries dropped
+#ifdef STACK_CHECK
+	COUNT_STACK_FREE,	// Fewest unused SRAM bytes below the stack, see stackCheck()
+#endif
+	COUNT_QUERY,		// Hits of each query
+	COUNTERS_SIZE = COUNT_QUERY + COUNT_QUERIES
+};
+uint16_t counters[COUNTERS_SIZE] = {0};
+
+const uint8_t diagQuery[] PROGMEM = {DIAG_START, 0x44, 0x0D};
+#define DIAG_QUERY_LENGTH	sizeof(diagQuery)
+#define DIAG_REPLY_LENGTH	(2 + sizeof(counters) + 1)
+
+#define COUNT(counter)		count(counter)
+
+static inline void count(uint8_t counter)
+{
+	if(counters[counter] != 0xFFFF) counters[counter]++;
+}
+
+uint16_t diagValue;	// Counter being sent
+
+// Byte of the diagnostic reply
+// Counter is copied with its LSB, so that both bytes are of the same count
+static uint8_t diagByte(uint8_t n)
+{
+	if(n == 0) return DIAG_START;
+	if(n == 1) return COUNTERS_SIZE;
+	if(n == DIAG_REPLY_LENGTH - 1) return 0x0D;
+	n -= 2;
+	if(n & 1) return diagValue >> 8;
+#ifdef USI_UART
+	// USI interrupt counts the receive buffer overflows
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+#endif
+	{
+		diagValue = counters[n >> 1];
+	}
+	return diagValue;
+}
+#else
+#define COUNT(counter)		do {} while(0)
+#endif
+
+#ifdef STACK_CHECK
+#ifndef COUNTERS
+#error "STACK_CHECK reports with the counters, build with COUNTERS"
+#endif
+/**
+ * Stack high-water mark
+ *
+ * SRAM from the end of the variables up to the top of the stack is
+ * painted with STACK_PAINT before main() and the first call. A byte the
+ * stack has reached is changed, so the lowest changed byte is the
+ * deepest the stack and interrupts on top of it have been. The main
+ * loop moves stackMark down to it a few bytes at a time, changed bytes
+ * may have unchanged ones in between (locals not written yet or equal to
+ * the paint) as long as the gap is shorter than STACK_SCAN.
+ *
+ * Free bytes left below the mark are in COUNT_STACK_FREE. Variables and
+ * stack collide if it goes to 0; build.sh prints the SRAM free for the
+ * stack of every build, this shows how much of it is really used.
+ */
+#define STACK_PAINT		0xC5
+#define STACK_SCAN		4	// Bytes checked per call
+
+extern uint8_t _end;		// End of the variables (.noinit), from the linker
+extern uint8_t __stack;		// Top of the stack, RAMEND
+uint8_t *stackMark = &__stack + 1;	// Lowest changed byte found
+
+// Runs after the stack pointer and zero register are set, copying of
+// .data and clearing of .bss follows in .init4. Naked and in section,
+// so it runs inline without a call.
+void stackPaint(void) __attribute__((naked, used, section(".init3")));
+void stackPaint(void)
+{
+	uint8_t *p = &_end;
+
+	while(p <= &__stack) *p++ = STACK_PAINT;
+}
+
+// Move the mark down to the lowest changed byte below it
+static void stackCheck(void)
+{
+	uint8_t *p = stackMark;
+	uint8_t i;
+
+	for(i = 0; i < STACK_SCAN && p > &_end; i++) {
+		if(*--p != STACK_PAINT) stackMark = p;
+	}
+	counters[COUNT_STACK_FREE] = stackMark - &_end;
+}
+#endif
+
+// Buffers are single producer, single consumer rings
+// Positions run freely and are masked only on access, so
+// write - read is the number of bytes in the buffer.
+// Producer writes data before moving write position and consumer
+// reads data before moving read position, so the buffers are safe
+// to share between an interrupt and the main loop.
+
 // Receive buffer
-#define UARTRXMASK		0x0F	// Buffer length = 16 bytes
-uint8_t uartRxBuffer[16] = {0};
-uint8_t uartRxWrite = 0;		// Write position (write to buffer)
-uint8_t uartRxRead = 0;			// Read position (read from buffer)
+#define UARTRXSIZE		16	// Buffer length, power of 2
+#define UARTRXMASK		(UARTRXSIZE - 1)
+uint8_t uartRxBuffer[UARTRXSIZE] = {0};
+uint8_t uartRxError[UARTRXSIZE] = {0};	// Errors of the byte, see below
+volatile uint8_t uartRxWrite = 0;	// Write position (write to buffer)
+volatile uint8_t uartRxRead = 0;	// Read position (read from buffer)
 
 // Transmit buffer
-#define UARTTXMASK		0x0F	// Buffer length = 16 bytes
-uint8_t uartTxBuffer[16] = {0x51, 0x32, 0x0D, 0x00, 0x00};
-uint8_t uartTxWrite = 0;		// Write position (write to buffer)
-uint8_t uartTxRead = 0;			// Read position (read from buffer, write to output)
+// Holds complete 11-bit frames, sent LSB first: bit 0 is the start bit (0),
+// bits 1...8 data, bit 9 even parity and bit 10 stop bit (1).
+// Frame is empty (0) right after the stop bit has been shifted out
+#define UARTTXSIZE		16	// Buffer length, power of 2
+#define UARTTXMASK		(UARTTXSIZE - 1)
+uint16_t uartTxBuffer[UARTTXSIZE] = {0};
+volatile uint8_t uartTxWrite = 0;	// Write position (write to buffer)
+volatile uint8_t uartTxRead = 0;	// Read position (read from buffer, write to output)
+
+// Reply queue
+// Matched queries wait here until their reply is due. Replies are sent
+// in the order of the queries, a reply that is due before the reply of
+// an earlier query waits for that one.
+#define REPLY_QUEUE		4	// Queue length, power of 2
+#define REPLY_QUEUE_MASK	(REPLY_QUEUE - 1)
+
+// Receive errors
+#define RX_PARITY_ERROR		0x01	// Parity bit does not match
+#define RX_FRAMING_ERROR	0x02	// No stop bit
+
+// Add received byte to buffer, byte is dropped if buffer is full
+// Bytes with errors are kept so that the matcher sees where the query ends
+static inline void uartRxPut(uint8_t data, uint8_t errors)
+{
+	if((uint8_t)(uartRxWrite - uartRxRead) < UARTRXSIZE) {
+		uartRxBuffer[uartRxWrite & UARTRXMASK] = data;
+		uartRxError[uartRxWrite & UARTRXMASK] = errors;
+		uartRxWrite++;
+	} else {
+		COUNT(COUNT_RX_OVERFLOW);
+	}
+}
+
+// Take next frame to send, buffer must not be empty
+static inline uint16_t uartTxGet(void)
+{
+	uint16_t frame = uartTxBuffer[uartTxRead & UARTTXMASK];
+	uartTxRead++;
+	return frame;
+}
+
+// Even parity bit for a byte
+static uint8_t evenParity(uint8_t b)
+{
+	b ^= b >> 4;
+	b ^= b >> 2;
+	b ^= b >> 1;
+	return b & 0x01;
+}
+
+// Serial frame of a byte, see transmit buffer
+static uint16_t uartFrame(uint8_t data)
+{
+	return (1 << 10) | (evenParity(data) << 9) | ((uint16_t)data << 1);
+}
 
 
 /**
- * Interrupt handler for timer 1
- * Triggers when timer reaches the compare value
+ * Interrupt handlers for timer 1
+ * Trigger when timer reaches the compare values
  *
- * Sets the trigger flag to 1, loops wait for this flag
+ * Set the trigger flag bits, loops wait for these flags
  * This clears the interrupt flag
+ *
+ * Flag is set with a single sbi, which does not touch SREG or any
+ * register, so the handlers need no prologue or epilogue: about 11
+ * cycles with the vector jump and reti instead of ~30. Host simulation
+ * and the timing instrumentation use the C handlers.
  */
+#ifdef DEBUG_TIMING
+volatile uint8_t timingMissed = 0;	// Ticks that fired before the previous one was handled
+#define TIMING_MISS(tick)	if((timerTriggered & (tick)) && timingMissed != 0xFF) timingMissed++
+#else
+#define TIMING_MISS(tick)
+#endif
+
+#if defined(__AVR__) && !defined(DEBUG_TIMING)
+ISR (TIMER1_COMPA_vect, ISR_NAKED)
+{
+	asm volatile("sbi %0, %1\n\treti" :: "I" (_SFR_IO_ADDR(GPIOR0)), "I" (TICK_TX_BIT));
+}
+
+ISR (TIMER1_COMPB_vect, ISR_NAKED)
+{
+	asm volatile("sbi %0, %1\n\treti" :: "I" (_SFR_IO_ADDR(GPIOR0)), "I" (TICK_RX_BIT));
+}
+#else
 ISR (TIMER1_COMPA_vect)
 {
-	timerTriggered = 1;
+	TIMING_MISS(TICK_TX);
+	timerTriggered |= TICK_TX;
+}
+
+ISR (TIMER1_COMPB_vect)
+{
+	TIMING_MISS(TICK_RX);
+	timerTriggered |= TICK_RX;
+}
+#endif
+
+#ifdef DEBUG_TIMING
+/**
+ * Loop timing instrumentation
+ *
+ * At the end of every loop iteration the time since the tick that
+ * started it is read from TCNT1 and collected to the maximum and to a
+ * histogram of 1/8 tick bins. Anything in the last bins is close to
+ * delaying the next tick, a missed tick means a bit was lost.
+ *
+ * Report is sent on the debug pin as 8N1 serial with one bit per TX
+ * tick, i.e. 9615 baud in Ushio mode and 38462 baud in Osram mode
+ * (19231 baud in Ushio mode with UART_OVERSAMPLE 8):
+ * 0xA5, max (us), missed ticks (total, saturates), histogram bins.
+ * The histogram covers the iterations since the previous report
+ * (about 110 ticks), so the 8 bit bins do not overflow.
+ */
+#define DEBUGPIN	ID1	// Open (pulled up) in both serial modes
+#define TIMING_BINS	8	// timingRecord() searches exactly 8
+#define TIMING_REPORT	(3 + TIMING_BINS)
+uint8_t timingMax = 0;				// Longest iteration, us from its tick
+uint8_t timingHistogram[TIMING_BINS] = {0};	// Iterations per 1/8 tick
+uint8_t timingBound[TIMING_BINS];		// Counts from the tick to each bin
+uint8_t timingReport[TIMING_REPORT];
+uint8_t timingByte = 0;		// Report byte being sent
+uint8_t timingBit = 0;		// 0 start bit, 1...8 data, 9 stop bit
+
+// Time from the tick to now, timer counts from 0 to OCR1C
+static inline uint8_t timingElapsed(uint8_t now, uint8_t tick)
+{
+	return (now >= tick) ? now - tick : now + OCR1C + 1 - tick;
+}
+
+// Bin bounds for the tick length of the protocol, divides only here
+// since there is no hardware divide
+static void timingStart(void)
+{
+	uint8_t i;
+
+	for(i = 0; i < TIMING_BINS; i++)
+		timingBound[i] = (uint16_t)i * (OCR1C + 1) / TIMING_BINS;
+}
+
+// Record the end of one loop iteration
+static void timingRecord(uint8_t ticks)
+{
+	uint8_t now = TCNT1;
+	uint8_t elapsed = 0, e, bin = 0;
+
+	// Both ticks may have started this iteration, the older one counts
+	if(ticks & TICK_TX)
+		elapsed = timingElapsed(now, OCR1A);
+	if(ticks & TICK_RX) {
+		e = timingElapsed(now, OCR1B);
+		if(e > elapsed) elapsed = e;
+	}
+
+	if(elapsed > timingMax) timingMax = elapsed;
+
+	// Binary search of the 8 bins
+	if(elapsed >= timingBound[bin + 4]) bin += 4;
+	if(elapsed >= timingBound[bin + 2]) bin += 2;
+	if(elapsed >= timingBound[bin + 1]) bin += 1;
+	timingHistogram[bin]++;
+}
+
+// Send next bit of the report, called on every TX tick
+static void timingOutput(void)
+{
+	uint8_t i;
+
+	if(timingBit == 0) {
+		if(timingByte == 0) {
+			// Take a snapshot and start collecting the next histogram
+			timingReport[0] = 0xA5;
+			timingReport[1] = timingMax;
+			timingReport[2] = timingMissed;
+			for(i = 0; i < TIMING_BINS; i++) {
+				timingReport[3 + i] = timingHistogram[i];
+				timingHistogram[i] = 0;
+			}
+		}
+		PORTB &= ~DEBUGPIN;
+	} else if(timingBit <= 8) {
+		if(timingReport[timingByte] & (1 << (timingBit - 1)))
+			PORTB |= DEBUGPIN;
+		else
+			PORTB &= ~DEBUGPIN;
+	} else {
+		PORTB |= DEBUGPIN;
+	}
+
+	if(++timingBit > 9) {
+		timingBit = 0;
+		if(++timingByte >= TIMING_REPORT)
+			timingByte = 0;
+	}
+}
+#endif
+
+// Trace record types, data is in parentheses
+#define TRACE_NONE	0x00	// Unused record
+#define TRACE_RX	0x10	// Received byte (byte), RX_*_ERROR in low bits
+#define TRACE_MATCH	0x20	// Query matched (query index)
+#define TRACE_DROP	0x30	// Unknown query ended (bytes)
+#define TRACE_TIMEOUT	0x40	// Incomplete query timed out (bytes)
+#define TRACE_REPLY	0x50	// Reply byte queued for TX (byte)
+
+#ifdef DEBUG_TRACE
+/**
+ * Protocol trace
+ *
+ * Serial loop records what it decoded and did to a ring of 4 byte
+ * records: type, data and the TX tick count (16 bits little endian,
+ * wraps). Writing a record is a few stores, the ring simply overwrites
+ * the oldest.
+ *
+ * Ring is not cleared at reset, only at power-up and when a serial
+ * loop starts. To read it, keep the emulator powered, strap both ID
+ * pins low (DEAD) and reset: the trace of the previous run is sent on
+ * TX at 2400 baud 8E1, 0xA5 and then all records oldest first, once a
+ * second. Unused records are all zeros.
+ */
+#define TRACE_SIZE	32	// Records, power of 2
+#define TRACE_MASK	(TRACE_SIZE - 1)
+#define TRACE_MAGIC	0x7EAC	// Ring holds a trace
+
+typedef struct {
+	uint8_t type;
+	uint8_t data;
+	uint16_t time;
+} traceRecord_t;
+
+traceRecord_t traceRing[TRACE_SIZE] __attribute__((section(".noinit")));
+uint8_t traceWrite __attribute__((section(".noinit")));
+uint16_t traceMagic __attribute__((section(".noinit")));
+uint16_t traceTime = 0;		// TX ticks
+
+#define TRACE(type, data)	traceAdd((type), (data))
+#define TRACE_TICK()		traceTime++
+
+static inline void traceAdd(uint8_t type, uint8_t data)
+{
+	traceRecord_t *record = &traceRing[traceWrite & TRACE_MASK];
+
+	record->type = type;
+	record->data = data;
+	record->time = traceTime;
+	traceWrite++;
+	SIM_TRACE(type, data);
+}
+
+// Start a new trace
+static void traceClear(void)
+{
+	memset(traceRing, 0, sizeof(traceRing));
+	traceWrite = 0;
+	traceMagic = TRACE_MAGIC;
+}
+
+// Send one byte as a 2400 baud frame, busy waiting
+static void traceSend(uint8_t data)
+{
+	uint16_t frame = uartFrame(data);
+	uint8_t i;
+
+	for(i = 0; i < 11; i++) {
+		if(frame & 0x01)
+			PORTB |= TXPIN;
+		else
+			PORTB &= ~TXPIN;
+		frame >>= 1;
+		_delay_us(1e6 / USHIO_BAUD);
+	}
+}
+
+// Send the trace over and over, does not return
+static void traceDump(void)
+{
+	uint8_t i, n;
+	const uint8_t *record;
+
+	PORTB = TXPIN;		// Idle high
+	DDRB = TXPIN;
+
+	while(1) {
+		if(traceMagic == TRACE_MAGIC) {
+			traceSend(0xA5);
+			for(i = 0; i < TRACE_SIZE; i++) {
+				record = (const uint8_t *)&traceRing[(traceWrite + i) & TRACE_MASK];
+				for(n = 0; n < sizeof(traceRecord_t); n++)
+					traceSend(record[n]);
+			}
+		}
+		_delay_ms(1000);
+	}
+}
+#else
+#define TRACE(type, data)	SIM_TRACE((type), (data))
+#define TRACE_TICK()		do {} while(0)
+#endif
+
+#ifdef USI_UART
+/**
+ * USI based UART
+ *
+ * Timer 0 runs in CTC mode at the bit rate and its compare match
+ * clocks the USI shift register. Falling edge of the start bit is
+ * detected with pin change interrupt on RX, after which the timer is
+ * started so that the first data bit is sampled at the bit center.
+ *
+ * USI shifts MSB first while the serial line is LSB first, so the
+ * bytes are mirrored when loading and reading the data register.
+ * USI has only one data register so RX and TX can not run at the
+ * same time, i.e. this is half-duplex.
+ */
+#define USI_PRESCALER		((1 << CS01) | (1 << CS00))	// CLK / 64 = 125 kHz
+
+// Timer 0 counts per bit
+// 2400 baud: 52 = 2404 baud (+0.2 %), 9600 baud: 13 = 9615 baud (+0.2 %)
+#define USI_BIT_COUNTS(baud)	((uint8_t)(F_CPU / 64 / (baud) + 0.5))
+
+// Timer 0 preset after start edge so that first compare match happens
+// after 1.5 bits. Timer counts from preset up to 255, wraps to 0 and
+// then counts to the compare value (bit counts - 1). OCF0A is set on the
+// clock that clears the timer from the compare value, so a CTC period
+// is bit counts and the first match is 256 - preset + bit counts
+// counts after the preset.
+#define USI_START_PRESET(counts)	(256 + (counts) - (3 * (counts) / 2))
+
+// Counter preload for USI, overflow after (16 - preload) bits
+#define USI_COUNT(bits)		(16 - (bits))
+
+typedef enum {USI_IDLE, USI_TX_FIRST, USI_TX_SECOND, USI_RX_DATA, USI_RX_STOP} usiState_t;
+volatile uint8_t usiState = USI_IDLE;
+uint8_t usiData = 0;		// Byte currently being received
+uint16_t usiFrame = 0;		// Frame currently being sent
+uint8_t usiBitCounts = 0;	// Timer 0 counts per bit
+uint8_t usiStartPreset = 0;	// Timer 0 preset at start bit edge
+
+// Mirror byte, USI is MSB first
+static uint8_t reverseBits(uint8_t b)
+{
+	b = (b >> 4) | (b << 4);
+	b = ((b & 0xCC) >> 2) | ((b & 0x33) << 2);
+	b = ((b & 0xAA) >> 1) | ((b & 0x55) << 1);
+	return b;
+}
+
+// Start timer 0 to clock the USI at the bit rate
+static void usiStartTimer(uint8_t preset)
+{
+	TCCR0B = 0;			// Stop timer
+	TCCR0A = (1 << WGM01);		// CTC mode
+	OCR0A = usiBitCounts - 1;
+	TCNT0 = preset;
+	GTCCR = (1 << PSR0);		// Reset the prescaler
+	TIFR = (1 << OCF0A);
+	TCCR0B = USI_PRESCALER;
+}
+
+// Stop the USI and wait for the next start bit
+static void usiStop(void)
+{
+	USICR = 0;			// TX pin back to PORTB control (idle high)
+	TCCR0B = 0;
+	usiState = USI_IDLE;
+	GIFR = (1 << PCIF);		// Forget edges seen during transfer
+	PCMSK = RXPIN;
+}
+
+// Load first half of next frame, 7 bits: start bit (0) in MSB, then data bits 0...5
+// DO follows the MSB directly so start bit goes out immediately
+static inline void usiTxFirst(void)
+{
+	usiFrame = uartTxGet();
+	USIDR = reverseBits(usiFrame);
+	USISR = (1 << USIOIF) | USI_COUNT(7);
+	usiState = USI_TX_FIRST;
+}
+
+// Start sending the next frame from the transmit buffer
+// Must be called with interrupts disabled when USI is idle
+static void usiTxStart(void)
+{
+	PCMSK = 0;			// Half-duplex, ignore RX while sending
+
+	usiTxFirst();
+	USICR = (1 << USIOIE) | (1 << USIWM0) | (1 << USICS0);	// Three-wire, timer 0 clock
+	usiStartTimer(0);
+}
+
+// Configure USI and RX start bit detection
+static void usiInit(uint8_t bitCounts)
+{
+	usiBitCounts = bitCounts;
+	usiStartPreset = USI_START_PRESET(bitCounts);
+
+	PORTB |= TXPIN;			// Idle high when USI does not drive the pin
+	PCMSK = RXPIN;
+	GIMSK = (1 << PCIE);
+}
+
+// Start bit edge on RX, start shifting in the data bits
+static inline void usiRxStart(void)
+{
+	PCMSK = 0;			// Data bits are shifted by the USI
+
+	// Wire mode 0 so that received bits are not output on DO
+	USIDR = 0xFF;
+	USISR = (1 << USIOIF) | USI_COUNT(8);
+	USICR = (1 << USIOIE) | (1 << USICS0);
+	usiState = USI_RX_DATA;
+	usiStartTimer(usiStartPreset);
+}
+
+/**
+ * USI counter overflow
+ * Handles the second half of the frame and the next byte
+ */
+ISR (USI_OVF_vect)
+{
+	uint8_t data;
+
+	switch(usiState) {
+	case USI_TX_FIRST:
+		// Remaining bits: bit 6 (already on DO), bit 7, parity, stop and idle
+		USIDR = reverseBits((usiFrame >> 7) | 0xF0);
+		USISR = (1 << USIOIF) | USI_COUNT(4);
+		usiState = USI_TX_SECOND;
+		break;
+	case USI_TX_SECOND:
+		// Stop bit done, continue with next frame without a gap
+		if(uartTxRead != uartTxWrite) {
+			usiTxFirst();
+		} else {
+			usiStop();
+		}
+		break;
+	case USI_RX_DATA:
+		// All 8 data bits received, first bit is in MSB
+		usiData = reverseBits(USIBR);
+		USISR = (1 << USIOIF) | USI_COUNT(2);		// Parity and stop bits
+		usiState = USI_RX_STOP;
+		break;
+	case USI_RX_STOP:
+	default:
+		data = USIBR;		// Parity in bit 1, stop in bit 0
+		// Matcher drops the query if parity or stop bit is wrong
+		uartRxPut(usiData, ((((data >> 1) & 0x01) != evenParity(usiData)) ? RX_PARITY_ERROR : 0) |
+			((data & 0x01) ? 0 : RX_FRAMING_ERROR));
+		usiStop();
+		break;
+	}
+}
+#else
+// Start bit edge seen by the pin change interrupt
+volatile uint8_t rxStartEdge = 0;
+volatile uint8_t rxInFrame = 0;		// Edges are data edges until stop bit
+
+// Timer 0 time stamps of the start edge, end of start bit and the last edge of the frame
+volatile uint8_t rxStartTime = 0;
+volatile uint8_t rxFirstEdge = 0;
+volatile uint8_t rxLastEdge = 0;
+
+// Start bit edge on RX
+// RX tick (compare B) is re-phased to the falling edge so that the
+// following RX ticks are exactly at whole ticks from the edge and
+// the bits get sampled at the bit center. TX tick is not touched,
+// so RX and TX run independently (full-duplex).
+static inline void rxStartBit(void)
+{
+	OCR1B = TCNT1;			// Next match one full tick from now
+	TIFR = (1 << OCF1B);
+	timerTriggered &= ~TICK_RX;
+
+	rxInFrame = 1;			// Data edges are only time stamped until stop bit
+	rxStartEdge = 1;
+}
+
+// Wait for the next start bit edge
+static void rxEdgeEnable(void)
+{
+	rxInFrame = 0;
+}
+
+/**
+ * Oscillator calibration
+ *
+ * Internal RC is factory calibrated to only +-10 % and drifts with
+ * temperature, so OSCCAL is tuned to the projector bit rate. Timer 0
+ * runs freely at 13.02 counts per bit and time stamps the edges of
+ * received frames. All edges are at whole bits from the start edge, so
+ * the distance to an edge in bits is its length in counts rounded to
+ * bits. Counts of many frames are compared to the nominal count of the
+ * same bits and OSCCAL is moved one step per 0.8 % of error, which is
+ * about the OSCCAL step size.
+ *
+ * Rounding is right only while the error over the measured bits is
+ * below half a bit. Until the clock is within a few steps, only the
+ * end of the start bit is used if it is at most 4 bits from the start
+ * edge (up to 12 % error), even if the frame was not received right.
+ * After that the last edge of good frames gives the full precision.
+ * Error of 3 % or more while locked starts the acquisition again.
+ * Edges far from a whole bit are noise and are not measured.
+ *
+ * Tuned value is saved to EEPROM once it is within the dead band and
+ * loaded at startup, so later power-ups start close to the right rate.
+ */
+#define CALIB_BIT		((uint16_t)(32 * F_CPU / 256 / USHIO_BAUD + 0.5))	// Counts per bit x 32
+#define CALIB_BITS		64	// Bits measured per adjustment
+#define CALIB_MAX_STEPS		8	// Largest adjustment at once
+#define CALIB_UNLOCK_STEPS	4	// Error that drops the lock, 3 %
+#define CALIB_ACQUIRE_EDGE	4	// Longest measurement before lock
+#define CALIB_ACQUIRE_BITS	24	// Bits measured per adjustment before lock
+#define CALIB_SLACK		(3 * CALIB_BIT / 8)	// Farthest edge from a whole bit
+
+// Timer 0 prescaler for 13.02 counts per bit
+#define CALIB_PRESCALER_USHIO	(1 << CS02)			// CLK / 256, 2400 baud
+#define CALIB_PRESCALER_OSRAM	((1 << CS01) | (1 << CS00))	// CLK / 64, 9600 baud
+
+// Steps of calibTask()
+#define CALIB_IDLE		0	// Waiting for a frame
+#define CALIB_FRAME_BAD		1	// Frame with wrong parity or stop bit to measure
+#define CALIB_FRAME_GOOD	2	// Frame to measure
+#define CALIB_ROUND		3	// Rounding the frame to whole bits
+#define CALIB_ADJUST		4	// Enough bits measured, compute the error
+#define CALIB_STEP		5	// Moving OSCCAL one step at a time
+#define CALIB_SAVE		6	// Saving the tuned value
+
+uint8_t calibState = CALIB_IDLE;
+uint8_t calibBits = 0;		// Bits measured since the last adjustment
+uint16_t calibCounts = 0;	// Timer 0 counts x 32 of those bits
+uint16_t calibExpected = 0;	// Nominal counts x 32 of those bits
+uint8_t calibLocked = 0;	// Clock close enough for long measurements
+uint8_t calibSaved = 0;		// Bytes of the tuned value saved
+uint8_t calibSavedValue;	// Tuned value saved first
+uint8_t calibEdge = 0;		// Frame: counts from the start edge to the edge measured
+uint8_t calibFrameBits;		// Frame: whole bits to the edge so far
+uint16_t calibMeasured;		// Frame: counts x 32 to the edge
+uint16_t calibRound;		// Frame: rounding edge, nominal counts x 32 of the bits + 1/2
+uint8_t calibSteps;		// Adjustment: OSCCAL steps moved
+uint16_t calibDiff, calibStep;	// Adjustment: error left, counts x 32 of one step
+
+// Saved OSCCAL and its complement, erased EEPROM does not pass the check
+uint8_t eeOsccal[2] EEMEM;
+
+// Load the saved calibration, it must be on the same OSCCAL range
+// since the two ranges overlap and the frequency jumps in between
+static void calibLoad(void)
+{
+	uint8_t value = eeprom_read_byte(&eeOsccal[0]);
+
+	if((value ^ eeprom_read_byte(&eeOsccal[1])) == 0xFF && !((value ^ OSCCAL) & 0x80))
+		OSCCAL = value;
+}
+
+// Frame received, good is set if its parity and stop bit were right
+// Only takes the time stamps before the next start edge, calibTask()
+// measures them later. Frames are not measured while it is busy.
+static inline void calibStop(uint8_t good)
+{
+	if(calibState != CALIB_IDLE) return;
+	calibEdge = (calibLocked ? rxLastEdge : rxFirstEdge) - rxStartTime;
+	calibState = good ? CALIB_FRAME_GOOD : CALIB_FRAME_BAD;
 }
 
-// This routine handles the USHIO serial communication
+// One step of the measurement and adjustment, each short enough to run
+// beside the UART in a tick of its own, see serialLoop()
+static void calibTask(void)
+{
+	uint8_t osccal;
+
+	switch(calibState) {
+	case CALIB_FRAME_BAD:
+	case CALIB_FRAME_GOOD:
+		if(calibLocked && calibState == CALIB_FRAME_BAD) {
+			calibState = CALIB_IDLE;
+			break;
+		}
+		calibMeasured = (uint16_t)calibEdge * 32;
+		calibRound = CALIB_BIT / 2;
+		calibFrameBits = 0;
+		calibState = CALIB_ROUND;
+		break;
+
+	case CALIB_ROUND:
+		// Round to whole bits, one bit per step
+		if(calibMeasured >= calibRound && calibFrameBits < 11) {
+			calibRound += CALIB_BIT;
+			calibFrameBits++;
+			break;
+		}
+		calibState = CALIB_IDLE;
+		if(!calibFrameBits) break;	// Only the start edge
+		if(calibMeasured + CALIB_BIT / 2 + CALIB_SLACK < calibRound || calibMeasured + CALIB_BIT / 2 >= calibRound + CALIB_SLACK)
+			break;			// Spike, not a bit edge
+		if(!calibLocked && calibFrameBits > CALIB_ACQUIRE_EDGE) break;
+
+		calibBits += calibFrameBits;
+		calibCounts += calibMeasured;
+		calibExpected += calibRound - CALIB_BIT / 2;
+		if(calibBits >= (calibLocked ? CALIB_BITS : CALIB_ACQUIRE_BITS))
+			calibState = CALIB_ADJUST;
+		break;
+
+	case CALIB_ADJUST:
+		// Too many counts means the clock runs fast, then OSCCAL is decreased
+		calibStep = calibExpected >> 7;
+		calibDiff = (calibCounts > calibExpected) ? calibCounts - calibExpected : calibExpected - calibCounts;
+		calibSteps = 0;
+		calibState = CALIB_STEP;
+		break;
+
+	case CALIB_STEP:
+		// One OSCCAL step per call, staying on the same range
+		if(calibDiff > calibStep && calibSteps < CALIB_MAX_STEPS) {
+			calibDiff -= calibStep;
+			calibSteps++;
+			osccal = OSCCAL;
+			if(calibCounts > calibExpected) {
+				if(osccal & 0x7F) OSCCAL = osccal - 1;
+			} else {
+				if(~osccal & 0x7F) OSCCAL = osccal + 1;
+			}
+			break;
+		}
+
+		// Lock when close, and drop back to acquiring on a large error
+		if(calibSteps <= 1)
+			calibLocked = 1;
+		else if(calibSteps >= CALIB_UNLOCK_STEPS)
+			calibLocked = 0;
+		calibBits = 0;
+		calibCounts = 0;
+		calibExpected = 0;
+		calibState = (!calibSteps && calibSaved < 2) ? CALIB_SAVE : CALIB_IDLE;
+		break;
+
+	case CALIB_SAVE:
+		// In the dead band, save once per power-up. EEPROM write takes
+		// 3.4 ms in the background, so one byte is written per adjustment
+		// and the loop never waits for the previous write.
+		if(eeprom_is_ready()) {
+			if(!calibSaved) {
+				calibSavedValue = OSCCAL;
+				eeprom_update_byte(&eeOsccal[0], calibSavedValue);
+			} else
+				eeprom_update_byte(&eeOsccal[1], ~calibSavedValue);
+			calibSaved++;
+		}
+		calibState = CALIB_IDLE;
+		break;
+	}
+}
+#endif
+
+#ifdef LEARN
+/**
+ * Learn mode
+ *
+ * Every distinct unknown query that was received without errors is
+ * stored to EEPROM with the number of times it was seen, so that the
+ * tables can be grown from what real projectors send.
+ *
+ * Query bytes are collected while the query is received, and when it
+ * is dropped as unknown the background task takes over, one step per
+ * tick without receive work: search the table one entry per step, then
+ * either count a hit or write the new entry one byte per step. EEPROM
+ * is only touched when it is ready, so a write in progress never stalls
+ * the loop. Queries with any byte received while the task is busy are
+ * not learned, repeated queries come again.
+ *
+ * Projectors poll, so hits are counted in SRAM and added to the EEPROM
+ * counts only every few minutes (LEARN_FLUSH_ROUNDS x 65536 ticks
+ * without receive work, about 7 min at 2400 baud and 4 ticks per bit).
+ * Hits since the last flush are lost at power off. Entry bytes are
+ * written before the length, so an entry is complete once it has a
+ * length.
+ */
+#define LEARN_ENTRIES		24	// Queries in EEPROM
+#define LEARN_QUERY_MAX		8	// Longer queries are stored truncated
+#define LEARN_FLUSH_ROUNDS	64
+#define LEARN_FREE		0xFF	// Length of unused (erased) entry
+
+typedef struct {
+	uint8_t query[LEARN_QUERY_MAX];
+	uint8_t count[2];		// Times seen, LSB first
+	uint8_t length;			// Query length, written last
+} learnEntry_t;
+
+// Magic marks the table for learn-read.py
+typedef struct {
+	uint8_t magic[2];		// "LQ"
+	learnEntry_t entry[LEARN_ENTRIES];
+} learnTable_t;
+
+learnTable_t eeLearn EEMEM;
+
+typedef enum {LEARN_IDLE, LEARN_SEARCH, LEARN_WRITE, LEARN_FLUSH} learnState_t;
+learnState_t learnState = LEARN_IDLE;
+uint8_t learnQuery[LEARN_QUERY_MAX];	// Query received or being learned
+uint8_t learnLength = 0;		// Bytes in learnQuery
+uint8_t learnBad = 0;			// Query had a receive error
+uint8_t learnStarted = 0;		// Query collected from its first byte on
+uint8_t learnEntry = 0;			// Entry searched, written or flushed
+uint8_t learnPos = 0;			// Byte written
+uint8_t learnHits[LEARN_ENTRIES] = {0};	// Hits not yet in EEPROM
+uint16_t learnTicks = 0;
+uint8_t learnRounds = 0;
+
+// Collect a byte of the query being received, depth counts from 1
+static inline void learnByte(uint8_t data, uint8_t errors, uint8_t depth)
+{
+	if(learnState != LEARN_IDLE) {
+		learnStarted = 0;	// Missed bytes, learnQuery is in use
+		return;
+	}
+	if(depth == 1) {
+		learnStarted = 1;
+		learnBad = 0;
+	}
+	if(errors) learnBad = 1;
+	if(depth <= LEARN_QUERY_MAX) learnQuery[depth - 1] = data;
+}
+
+// Unknown query of depth bytes was dropped
+static inline void learnUnknown(uint8_t depth)
+{
+	if(learnState != LEARN_IDLE || !learnStarted || learnBad) return;
+	learnStarted = 0;
+	learnLength = (depth < LEARN_QUERY_MAX) ? depth : LEARN_QUERY_MAX;
+	learnEntry = 0;
+	learnState = LEARN_SEARCH;
+}
+
+// Byte of the new entry in write order: magic, query, count (1) and length
+static uint8_t learnImage(uint8_t pos, uint8_t **address)
+{
+	learnEntry_t *entry = &eeLearn.entry[learnEntry];
+
+	if(pos < 2) {
+		*address = &eeLearn.magic[pos];
+		return pos ? 'Q' : 'L';
+	}
+	pos -= 2;
+	if(pos < learnLength) {
+		*address = &entry->query[pos];
+		return learnQuery[pos];
+	}
+	pos -= learnLength;
+	if(pos < 2) {
+		*address = &entry->count[pos];
+		return pos ? 0 : 1;
+	}
+	*address = &entry->length;
+	return learnLength;
+}
+
+// One step of background EEPROM work
+static void learnTask(void)
+{
+	learnEntry_t *entry;
+	uint8_t *address;
+	uint8_t value, i;
+	uint16_t hits;
+
+	if(!++learnTicks && ++learnRounds >= LEARN_FLUSH_ROUNDS && learnState == LEARN_IDLE) {
+		learnRounds = 0;
+		learnEntry = 0;
+		learnPos = 0;
+		learnStarted = 0;	// Flush uses learnQuery for the counts
+		learnState = LEARN_FLUSH;
+	}
+	if(learnState == LEARN_IDLE || !eeprom_is_ready()) return;
+
+	entry = &eeLearn.entry[learnEntry];
+	if(learnState == LEARN_SEARCH) {
+		// Entries are used in order, first free one ends the table
+		value = eeprom_read_byte(&entry->length);
+		if(value == LEARN_FREE) {
+			learnPos = 0;
+			learnState = LEARN_WRITE;
+			return;
+		}
+		if(value == learnLength) {
+			for(i = 0; i < learnLength; i++) {
+				if(eeprom_read_byte(&entry->query[i]) != learnQuery[i]) break;
+			}
+			if(i == learnLength) {
+				if(learnHits[learnEntry] != 0xFF) learnHits[learnEntry]++;
+				learnState = LEARN_IDLE;
+				return;
+			}
+		}
+		if(++learnEntry >= LEARN_ENTRIES)
+			learnState = LEARN_IDLE;	// Table full
+	} else if(learnState == LEARN_WRITE) {
+		value = learnImage(learnPos, &address);
+		eeprom_update_byte(address, value);
+		if(address == &entry->length)
+			learnState = LEARN_IDLE;
+		learnPos++;
+	} else {
+		// Flush, read the count of an entry with hits and write it back
+		if(learnPos == 0) {
+			if(learnHits[learnEntry]) {
+				hits = eeprom_read_byte(&entry->count[0]) | (eeprom_read_byte(&entry->count[1]) << 8);
+				hits = (hits > 0xFFFF - learnHits[learnEntry]) ? 0xFFFF : hits + learnHits[learnEntry];
+				learnHits[learnEntry] = 0;
+				learnQuery[0] = hits;		// Not collecting, see learnStarted
+				learnQuery[1] = hits >> 8;
+				learnPos = 1;
+				return;
+			}
+		} else {
+			eeprom_update_byte(&entry->count[learnPos - 1], learnQuery[learnPos - 1]);
+			if(++learnPos <= 2) return;
+		}
+		learnPos = 0;
+		if(++learnEntry >= LEARN_ENTRIES)
+			learnState = LEARN_IDLE;
+	}
+}
+
+#define LEARN_BYTE(data, errors, depth)	learnByte((data), (errors), (depth))
+#define LEARN_UNKNOWN(depth)		learnUnknown(depth)
+#else
+#define LEARN_BYTE(data, errors, depth)	do {} while(0)
+#define LEARN_UNKNOWN(depth)		do {} while(0)
+#endif
+
+// 3-wire mode lamp state, updated by the pin change interrupt
+volatile uint8_t flagLampOn = 0;
+volatile uint8_t flagDimOn = 0;
+
+#ifdef FLAG_PWM
+/**
+ * Lamp power PWM in 3-wire mode
+ *
+ * Attiny85 has no input capture and the timer 0 outputs are on DIM and
+ * the flag, so timer 0 time stamps the DIM edges in the pin change
+ * interrupt and timer 1 drives the PWM on its inverted OC1B output,
+ * which is ID0 (PB3). ID0 is open in 3-wire mode, ID1 (OC1B) is strapped
+ * low and is left as input. With -DMODE=FLAG ID0 must be left open too.
+ *
+ * DIM high gives full power and DIM low gives FLAG_PWM_DIM. When DIM
+ * pulses, the power is in between by the time DIM is high, measured
+ * from the last high and low pulse. DIM is a level again when it has
+ * not changed for FLAG_DIM_STATIC timer 0 overflows. Duty only changes
+ * on the edges and overflows, the PWM itself runs in hardware.
+ */
+#define FLAG_PWM_PIN		ID0
+#define FLAG_PWM_FULL		255	// Duty of full power, 255 = always on
+#define FLAG_PWM_DIM		192	// Duty of dimmed lamp, 75 %
+#define FLAG_DIM_PRESCALER	(1 << CS02)	// CLK / 256, 32 us, 8 ms overflow
+#define FLAG_DIM_STATIC		2	// Overflows without DIM edges
+
+uint8_t flagDimEdge = 0;		// Timer 0 time of the last DIM edge
+uint8_t flagDimHigh = 0xFF;		// Last pulse widths, 0xFF = longer
+uint8_t flagDimLow = 0xFF;
+volatile uint8_t flagDimAge = FLAG_DIM_STATIC;	// Timer 0 overflows since the DIM edge
+
+ISR (TIMER0_OVF_vect)
+{
+	if(flagDimAge < FLAG_DIM_STATIC) flagDimAge++;
+}
+
+// Measure the DIM pulse that ended at time now
+static inline void flagDimPulse(uint8_t now, uint8_t dimOn)
+{
+	uint8_t width = now - flagDimEdge;
+	uint8_t age = flagDimAge;
+
+	// Overflow that is not yet counted
+	if((TIFR & (1 << TOV0)) && now < 0x80) age++;
+	if(age > 1 || (age && now >= flagDimEdge)) width = 0xFF;
+
+	if(dimOn)
+		flagDimHigh = width;	// Falling edge ends a high pulse
+	else
+		flagDimLow = width;
+	flagDimEdge = now;
+	flagDimAge = 0;
+}
+
+// Set the PWM duty from the lamp state, called after each interrupt
+// Ends of the duty range are driven as levels, the PWM would leave a
+// spike of one count at each end
+static void flagPwmUpdate(void)
+{
+	uint8_t duty, high, low;
+
+	cli();
+	high = flagDimHigh;
+	low = flagDimLow;
+	if(!flagLampOn)
+		duty = 0;
+	else if(flagDimAge < FLAG_DIM_STATIC && high != 0xFF && low != 0xFF)
+		duty = FLAG_PWM_DIM + (uint16_t)(FLAG_PWM_FULL - FLAG_PWM_DIM) * high / (high + low);
+	else
+		duty = flagDimOn ? FLAG_PWM_DIM : FLAG_PWM_FULL;
+	sei();
+
+	if(duty == 0 || duty == 255) {
+		GTCCR = 0;		// Pin follows PORTB
+		if(duty)
+			PORTB |= FLAG_PWM_PIN;
+		else
+			PORTB &= ~FLAG_PWM_PIN;
+	} else {
+		// Inverted output is high from the compare match to the top
+		OCR1B = 255 - duty;
+		GTCCR = (1 << PWM1B) | (1 << COM1B0);
+	}
+}
+#endif
+
+// Check DIM and Sync pins and set the flag output
+static inline void flagUpdate(void)
+{
+#ifdef FLAG_PWM
+	uint8_t now = TCNT0;	// Time stamp first
+#endif
+	uint8_t pin_status = PINB;
+	uint8_t dimOn = !(pin_status & RXPIN);
+
+	// Check DIM/RXD; if pin is low, then dim the lamp
+#ifdef FLAG_PWM
+	if(dimOn != flagDimOn) flagDimPulse(now, dimOn);
+#endif
+	flagDimOn = dimOn;
+
+	// Check SCI/Sync
+	// If pin is low, turn lamp ON
+	// Flag follows the request to turn on the light immediately
+	if(!(pin_status & SYNCPIN)) {
+		flagLampOn = 1;
+		PORTB |= TXPIN;
+	} else {
+		flagLampOn = 0;
+		PORTB &= ~TXPIN;
+	}
+}
+
+/**
+ * Pin change interrupt
+ *
+ * In 3-wire mode updates the flag as soon as DIM or Sync changes,
+ * in serial modes detects the start bit of the received byte and
+ * time stamps the data edges for the oscillator calibration
+ */
+ISR (PCINT0_vect)
+{
+#ifndef USI_UART
+	uint8_t now = TCNT0;	// Time stamp first
+#endif
+
+	if(operationMode == FLAG) {
+		flagUpdate();
+		return;
+	}
+
+#ifdef USI_UART
+	// Only falling edge starts the reception
+	if(PINB & RXPIN) return;
+
+	usiRxStart();
+#else
+	if(rxInFrame) {
+		if(rxFirstEdge == rxStartTime) rxFirstEdge = now;
+		rxLastEdge = now;
+		return;
+	}
+
+	// Only falling edge starts the reception
+	if(PINB & RXPIN) return;
+
+	rxStartTime = now;
+	rxFirstEdge = now;
+	rxLastEdge = now;
+	rxStartBit();
+#endif
+}
+
+#ifdef EEPROM_TABLE
+// Copy the table of the protocol to SRAM, from EEPROM if it has a valid
+// table for the mode and from flash otherwise. Protocol is updated to
+// point to the copy.
+static void tableLoad(serialProtocol_t *protocol)
+{
+	const uint8_t *ee = (const uint8_t *)TABLE_ADDRESS;
+	uint8_t header[TABLE_HEADER];
+	uint8_t i, sum = 0, indexSize;
+	uint16_t replyStart, length;	// Header sizes of a bad table add up past 255
+
+	for(i = 0; i < TABLE_HEADER; i++) {
+		header[i] = eeprom_read_byte(&ee[i]);
+		sum += header[i];
+	}
+	indexSize = header[6] + 1;
+	replyStart = (uint16_t)header[7] + indexSize;
+	length = replyStart + 2 * (uint16_t)header[8] + 2 * (uint16_t)header[6];
+
+	// Every part must fit the buffer, matcher at least the root state
+	if(header[0] == 'Q' && header[1] == 'T' && header[2] == protocol->mode &&
+	   header[6] <= TABLE_MAX_QUERIES && header[7] >= 2 && header[7] <= sizeof(tableRam) &&
+	   header[8] <= sizeof(tableRam) / 2 && length <= sizeof(tableRam)) {
+		for(i = 0; i < length; i++) {
+			tableRam[i] = eeprom_read_byte(&ee[TABLE_HEADER + i]);
+			sum += tableRam[i];
+		}
+		sum += eeprom_read_byte(&ee[TABLE_HEADER + length]);
+
+		// Root state must be inside the matcher
+		if(2 + 2 * (uint16_t)tableRam[1] > header[7]) sum = 1;
+
+		// No query may start like the diagnostic query
+		for(i = 0; i < tableRam[1] && !sum; i++) {
+			if(tableRam[2 + 2 * i] == DIAG_START) sum = 1;
+		}
+		if(!sum) {
+			protocol->maxQuery = header[3];
+			protocol->terminator = header[4] | (header[5] << 8);
+			protocol->queries = header[6];
+			protocol->matcherSize = header[7];
+			protocol->replySize = header[8];
+			protocol->matcher = tableRam;
+			protocol->dispatch = 0;		// Only matches the built in table
+			protocol->replyIndex = &tableRam[header[7]];
+			protocol->reply = (const uint16_t *)&tableRam[replyStart];
+			protocol->replyDelay = (const uint16_t *)&tableRam[replyStart + 2 * header[8]];
+			return;
+		}
+	}
+
+	// Built in table
+	indexSize = protocol->queries + 1;
+	replyStart = protocol->matcherSize + indexSize;
+	length = replyStart + 2 * protocol->replySize;
+	memcpy_P(tableRam, protocol->matcher, protocol->matcherSize);
+	memcpy_P(&tableRam[protocol->matcherSize], protocol->replyIndex, indexSize);
+	memcpy_P(&tableRam[replyStart], protocol->reply, 2 * protocol->replySize);
+	memcpy_P(&tableRam[length], protocol->replyDelay, 2 * protocol->queries);
+	protocol->matcher = tableRam;
+	protocol->replyIndex = &tableRam[protocol->matcherSize];
+	protocol->reply = (const uint16_t *)&tableRam[replyStart];
+	protocol->replyDelay = (const uint16_t *)&tableRam[length];
+}
+#endif
+
+// Advance the query matcher with one received byte
+// State record is: matched query, number of transitions, {byte, next state}
+static uint8_t matchByte(const serialProtocol_t *protocol, uint8_t state, uint8_t data)
+{
+	const uint8_t *edge = &protocol->matcher[state + 1];
+	uint8_t n;
+
+	if(!state && protocol->dispatch)
+		return pgm_read_byte(&protocol->dispatch[data]);
+
+	for(n = TABLE_BYTE(edge++); n; n--, edge += 2) {
+		if(TABLE_BYTE(edge) == data)
+			return TABLE_BYTE(edge + 1);
+	}
+
+	return MATCH_DISCARD;	// No query starts with received bytes
+}
+
+// This routine handles the USHIO and OSRAM serial communication
 // USHIO driver uses a 2400 baud serial communication
 // with bus idling high (1), then 1 start bit (0),
 // 8 data bits (LSB first?), 1 parity bit (if data has odd 1s, then parity is 1),
 // and 1 stop bit (1).
-// Currently this only handles half-duplex communication, i.e. if data is received during transmit, it is not parsed
-void ushioLoop(void)
+// OSRAM is assumed to use the same framing at 9600 baud.
+// Software UART is full-duplex, RX has its own tick so queries received
+// during transmit are parsed and their replies queued behind the current one.
+// USI UART is half-duplex, i.e. if data is received during transmit, it is not parsed
+// Reply is due after the delay of its query, counted in TX ticks from
+// the stop bit of the last query byte. On an idle line the software UART
+// starts the start bit 3 ticks after the reply is due, behind another
+// reply right after its stop bit.
+//
+// Work is budgeted per tick, from one TX tick to the next: the TX tick
+// iteration and the RX tick iteration in it together do at most one
+// long step, the rest waits for a later tick. Long steps are an RX bit
+// decision, taking the next TX bit from the frame, taking a received
+// byte from the buffer, matching it, the start of a reply, a reply
+// frame to the TX buffer, or one step of slow work (calibration, stack
+// check, learn mode). An RX decision can not wait, so the TX tick before
+// it leaves the tick to it. The TX bit tick only hands over the bit that
+// was taken earlier, in any tick with time during the previous bit.
+// Estimated cycles by instruction count (-Os), not measured:
+//   timer 1 compare A and B interrupts	2 x ~11 cycles
+//   wait and fetch tick flags		2 x ~10
+//   RX sample				~10
+//   TX output and bit tick, timeout, gap	~45
+//   checks that find no work		~25
+//   data edge time stamp (interrupt)	~25
+// is ~147 per tick, plus one long step:
+//   RX bit decision			~35, stop bit ~55
+//   next TX bit, from a new frame	~15, ~35
+//   received byte from the buffer	~25
+//   match byte, n = transitions of state	~20 + 12 n, first byte ~25
+//   reply start from the queue		~40
+//   reply frame to TX buffer		~35
+//   calibration step			~45, EEPROM save ~50
+//   stack check (STACK_CHECK)		~50
+// Longest tick is ~200 cycles, below the 26 us (208 cycle) tick of
+// Osram, with n <= 3 (the Ushio table has at most 2 after the first
+// byte). The margin is small, DEBUG_TIMING measures it on the device:
+// the longest tick must stay below the tick period and missed ticks at
+// 0. The tick flags are latched, so a tick that runs late only delays
+// the next one, but a tick is lost if the work of one tick period takes
+// longer than the period. LEARN steps read up to a whole EEPROM entry
+// (~130) and only fit the 104 or 52 us tick of Ushio at 4 or 8 ticks
+// per bit.
+void serialLoop(const serialProtocol_t *protocol_P)
 {
-	uint8_t rxLastBit = 0;
+	serialProtocol_t protocol;
+
+#ifndef USI_UART
 	uint8_t rxBit = 0;
+	uint8_t rxSamples = 0;	// Last RX samples, newest in bit 0
+	uint8_t rxStartTicks;	// Ticks from the first tick of a start bit to its decision
+	uint8_t rxVote;		// Bits are decided by majority of three samples
 	uartState_t uartRxState = IDLE;
 	uint8_t rxParity = 0;
 	uint8_t rxTick = 0;
 	uint8_t readBit = 1;	// Bit number
+	uint8_t rxByte = 0;	// Byte being received
+	uint8_t rxParityOk = 0;
 
+#ifndef DEBUG_ECHO
 	uint8_t txBit = 1;	// Bus idles high
-	uartState_t uartTxState = IDLE;
-	uint8_t txParity = 0;
+	uint8_t txNext = 1;	// Next bit, ready for the next bit tick
+#endif
+	uint8_t txReady = 0;	// txNext is set
 	uint8_t txTick = 0;
-	uint8_t writeBit = 1;	// Bit number
+	uint16_t txFrame = 0;	// Bits of the frame not yet sent
+	uint8_t txIdle = 0;	// Stop bit of the last frame is complete
+#endif
 
 	uint16_t rxTimeout = 0;	// Command timeout / synchronisation
+	uint16_t rxGap = 0;	// Ticks left for the next byte of the command
+
+	uint8_t matchState = 0;	// Query matcher state, 0 = waiting for new query
+	uint8_t matchDepth = 0;	// Bytes received for current query
+	uint8_t matchPending = 0;	// Byte taken from the buffer, not yet matched
+	uint8_t rxData = 0, rxErrors = 0, query, handled;
+	uint8_t step = 0;	// Tick has no time left for a long step
+#if !defined(USI_UART) || defined(LEARN) || defined(STACK_CHECK)
+#define BACKGROUND		// Calibration, learn mode or stack check
+	uint8_t background;	// Tick has time for slow work
+#endif
+	uint8_t length = 0;	// Reply frames not yet in transmit buffer
+	const uint16_t *reply = 0;
+	uint8_t ticks;
+	uint16_t tickCount = 0;	// TX ticks, time base of the reply delays
+	uint8_t delayShift;	// Ticks per 1/4 bit, log 2
+	uint8_t replyQuery[REPLY_QUEUE];	// Queries waiting for their reply
+	uint16_t replyDue[REPLY_QUEUE];		// Tick count the reply starts at
+	uint8_t replyWrite = 0, replyRead = 0;
+#ifdef COUNTERS
+	uint8_t diagDepth = 0;	// Bytes of the diagnostic query received
+	uint8_t diagLength = 0;	// Diagnostic reply frames not yet in transmit buffer
+#endif
 
-	uint8_t i, j, failed;
+	memcpy_P(&protocol, protocol_P, sizeof(protocol));
+#ifdef EEPROM_TABLE
+	tableLoad(&protocol);
+#endif
+
+#ifndef USI_UART
+	// Decision is at the bit center, or one tick later when the samples
+	// in the center ticks are voted. First tick of the start bit is 1/4
+	// bit after the edge at 4 ticks per bit and 1/8 bit at 8.
+	rxVote = protocol.bitTicks >= 8;
+	rxStartTicks = protocol.bitTicks / 2 - 1 + rxVote;
+#endif
+	delayShift = protocol.bitTicks >> 3;	// 4 or 8 ticks per bit
+
+#ifdef DEBUG_TIMING
+	DDRB |= DEBUGPIN;	// Pull-up is on, so the pin idles high
+	timingStart();
+#endif
+#ifdef DEBUG_TRACE
+	traceClear();
+#endif
 
 	while(1)
 	{
 		// Wait for timer, everything is done after clock pulse
-		while(!timerTriggered);
+		while(!timerTriggered) SIM_WAIT();
+		cli();
+		ticks = timerTriggered;
 		timerTriggered = 0;
+		sei();
+		if(ticks & TICK_TX) step = 0;	// TX tick starts the next tick
 
-		// Check status on RXD
-		rxLastBit = rxBit;	// Store current bit to detect edges
-		rxBit = PINB & RXPIN;
+#ifdef DEBUG_TIMING
+		if(ticks & TICK_TX) timingOutput();
+#endif
 
-		// Write correct level (or keep existing) to TXD
+#ifdef USI_UART
+		// USI shifts the bits in the background, only start the transmit here
+		cli();
+		if(usiState == USI_IDLE && uartTxRead != uartTxWrite)
+			usiTxStart();
+		sei();
+
+		if(ticks & TICK_TX) {
+			if(rxTimeout) rxTimeout--;
+			if(rxGap) rxGap--;
+			tickCount++;
+			TRACE_TICK();
+		}
+#else
+		if(ticks & TICK_RX) {
+			// Sample RXD
+			rxSamples = (rxSamples << 1) | ((PINB & RXPIN) ? 1 : 0);
+			if(rxTick) rxTick--;
+		}
+
+		if(ticks & TICK_TX) {
+			// Write correct level (or keep existing) to TXD
 #ifdef DEBUG_ECHO
-		if(rxBit)
-			PORTB |= TXPIN;
-		else
-			PORTB &= ~TXPIN;
+			if(PINB & RXPIN)
+				PORTB |= TXPIN;
+			else
+				PORTB &= ~TXPIN;
 #else
-		if(txBit)
-			PORTB |= TXPIN;
-		else
-			PORTB &= ~TXPIN;
+			if(txBit)
+				PORTB |= TXPIN;
+			else
+				PORTB &= ~TXPIN;
 #endif
+			if(txTick) txTick--;
+			if(rxTimeout) rxTimeout--;
+			if(rxGap) rxGap--;
+			tickCount++;
+			TRACE_TICK();
+		}
 
-		// Timers for read & write
-		if(rxTick) rxTick--;
-		if(txTick) txTick--;
-		if(rxTimeout) rxTimeout--;
-
-		// uart RX is handled only on certain ticks (when rxTick == 0)
-		if(!rxTick) {
-			// Also check last bit so does not trigger if
-			// signal idles low for some reason
-			if(uartRxState == IDLE && rxBit == 0 && rxLastBit == 1) {
-				// Start bit received
+		// uart RX is handled only on certain RX ticks (when rxTick == 0)
+		if((ticks & TICK_RX) && !rxTick) {
+			if(uartRxState != IDLE) step = 1;	// Idle line is only checked for an edge
+			if(rxVote)
+				rxBit = (RX_MAJORITY >> (rxSamples & 0x07)) & 0x01;
+			else
+				rxBit = rxSamples & 0x01;
+
+			// Pin change interrupt only triggers on falling edge so
+			// this does not trigger if signal idles low for some reason
+			if(uartRxState == IDLE && rxStartEdge) {
+				// Start bit received, this is the first tick after the edge
+				rxStartEdge = 0;
 				uartRxState = START;
-				rxTick = 1;		// Verify start on next tick
+				rxTick = rxStartTicks;	// Verify start at the middle of start bit
 			} else if(uartRxState == START) {
 				if(rxBit == 0) {
 					// Still zero -> OK, start reading
 					rxParity = 0;
 					readBit = 1;		// LSB first
 					uartRxState = DATA;
-					uartRxBuffer[uartRxWrite] = 0;		// Clear byte
-					rxTick = 4;		// Read after 1 complete cycle => 2400 baud
-
-					// Set up timeout
-					if(!rxTimeout) rxTimeout = UART_RX_TIMEOUT;
+					rxByte = 0;		// Clear byte
+					rxTick = protocol.bitTicks;	// Read after 1 complete bit
 				} else {
 					// Glitch probably? Back to idle
 					uartRxState = IDLE;
 					rxTick = 0;
+					rxEdgeEnable();
 				}
 			} else if(uartRxState == DATA) {
 				// Handle data bits
 				// Turn bit to 1 if data bus was high
 				if(rxBit) {
-					uartRxBuffer[uartRxWrite] |= readBit;
+					rxByte |= readBit;
 					rxParity ^= 1;		// Toggle expected parity bit (even parity)
 				}
 				readBit <<= 1;		// Next bit
 				if(!readBit) {
 					// Overflow -> last bit was just read
 					uartRxState = PARITY;		// Next up is parity bit
-					uartRxWrite = (uartRxWrite + 1) & UARTRXMASK;	// Change write position in buffer
 				}
 
-				rxTick = 4;			// Schedule next bit
+				rxTick = protocol.bitTicks;	// Schedule next bit
 			} else if(uartRxState == PARITY) {
-				// Parity bit, currently do not care
-				if(rxBit != rxParity) {;}	// TODO: Handle parity error?
+				rxParityOk = (rxBit == rxParity);
 				uartRxState = STOP;
-				rxTick = 4;
-			} else {
-				// Stop bit
-				if(!rxBit) {;} 		// TODO: If no STOP bit, handle the error?
+				rxTick = protocol.bitTicks;
+			} else if(uartRxState == STOP) {
+				// Byte complete, add to buffer. Wrong parity or missing
+				// stop bit marks it bad and the matcher drops its query.
+				uartRxPut(rxByte, (rxParityOk ? 0 : RX_PARITY_ERROR) | (rxBit ? 0 : RX_FRAMING_ERROR));
+				calibStop(rxBit && rxParityOk);
 				uartRxState = IDLE;
 				rxTick = 0;		// Next falling edge instantaneously trigs new receive
+				rxEdgeEnable();
 			}
 		}
 
+		// RX bit decision in the rest of this tick takes its long step
+		if((ticks & TICK_TX) && uartRxState != IDLE && rxTick <= 1) step = 1;
+
 		// TX is handled similarly, but is a bit simpler
-		if(!txTick) {
-			txTick = 4;		// Everything happens at the same baud rate
-
-			if(uartTxState == START) {
-				txBit = 0;			// Start bit always low
-				writeBit = 1;
-				txParity = 0;
-				uartTxState = DATA;
-			} else if(uartTxState == DATA) {
-				// Handle data bits
-				if(uartTxBuffer[uartTxRead] & writeBit) {
-					txBit = 1;
-					txParity ^= 1;		// Toggle expected parity bit (even parity)
-				} else {
-					txBit = 0;
-				}
-				writeBit <<= 1;		// Next bit
-				if(!writeBit) {
-					// Overflow -> last bit was just read
-					uartTxState = PARITY;		// Next up is parity bit
-					uartTxRead = (uartTxRead + 1) & UARTTXMASK;	// Change read position in buffer
-				}
-			} else if(uartTxState == PARITY) {
-				// Send parity bit
-				txBit = txParity;
-				uartTxState = STOP;
+		// Next bit is already taken from the frame, the bit tick only
+		// hands it to the output
+		if((ticks & TICK_TX) && !txTick) {
+			txTick = protocol.bitTicks;	// Everything happens at the same baud rate
+
+			if(txReady) {
+#ifndef DEBUG_ECHO
+				txBit = txNext;
+#endif
+				txReady = 0;
 			} else {
-				// Stop bit
-				txBit = 1;		// Stop bit always high
-				uartTxState = IDLE;
+				txIdle = 1;
 			}
 		}
 
-		// Get ready to send next byte if in buffer
-		if(uartTxState == IDLE) {
-			if(uartTxRead < uartTxWrite) {
-				// New data in buffer
-				uartTxState = START;	// Start sending
-			} else {
-				// Clear buffer
-				uartTxRead = 0;
-				uartTxWrite = 0;
+		// Take the bit after it from the frame, or from the next frame
+		// in the buffer. That has the rest of the bit for a tick with time.
+		if(!step && !txReady && (txFrame || uartTxRead != uartTxWrite)) {
+			if(!txFrame)
+				txFrame = uartTxGet();
+#ifndef DEBUG_ECHO
+			txNext = txFrame & 0x01;	// Echo drives TX instead
+#endif
+			txFrame >>= 1;
+			txReady = 1;
+			step = 1;
+			if(txIdle) {
+				// Idle line starts the start bit on the next tick
+				// instead of whenever the idle bit ends, so the reply
+				// latency does not depend on the phase of the TX bits
+#ifndef DEBUG_ECHO
+				txBit = txNext;
+#endif
+				txReady = 0;
+				txTick = protocol.bitTicks;
+				txIdle = 0;
 			}
 		}
+#endif
 
-		// Check received data and send response if necessary
-		if(uartRxState == IDLE && uartRxWrite > 0) {
-			// Bytes in buffer and bus is idle
-			// Check if any message matches the received data
-
-			failed = 0;
-			for(i=0; i<USHIO_QUERIES; i++){
-				failed &= 0xFE;		// Clear lowest bit
-				if(uartRxWrite >= ushioQuery[i].qLength) {
-					// Received enough bytes, check contents
-					for(j=0; j<ushioQuery[i].qLength; j++) {
-						if(uartRxBuffer[j] != ushioQuery[i].qData[j]){
-							failed |= 0x01;		// bit 1 => this data did not match
-							break;
-						}
-					}
-
-					if(!(failed & 0x01)) {
-						// All bytes match -> add response to buffer
-
-						// Check that buffer has space
-						if(UARTTXMASK > uartTxWrite + ushioQuery[i].rLength) {
-							for(j=0; j<ushioQuery[i].rLength; j++) {
-								// Append response to buffer
-								uartTxBuffer[uartTxWrite++] = ushioQuery[i].rData[j];
-							}
-						}
-
-						// Clear fail bit to indicate that the message was handled
-						// Ie RX buffer can be cleared even though some messages may be longer still
-						failed = 0;
-
-						// Break out of the for loop
-						break;
-					}
-				} else {
-					failed |= 0x02; // Some messages are longer than what is received so far
+		// Drop incomplete query after timeout or a gap between the bytes
+		if(matchDepth && !matchPending && (!rxTimeout || !rxGap)) {
+			TRACE(TRACE_TIMEOUT, matchDepth);
+			COUNT(COUNT_TIMEOUT);
+			matchState = 0;
+			matchDepth = 0;
+#ifdef COUNTERS
+			diagDepth = 0;
+#endif
+		}
+
+		// Check received data and queue response if necessary
+		// Every byte is fed to the matcher as soon as its stop bit is received,
+		// in two steps: take it from the buffer, then match it
+		// Matcher waits while the reply queue is full
+#ifdef COUNTERS
+		if(!step && !matchPending && (uint8_t)(replyWrite - replyRead) < REPLY_QUEUE && !diagLength && uartRxRead != uartRxWrite) {
+#else
+		if(!step && !matchPending && (uint8_t)(replyWrite - replyRead) < REPLY_QUEUE && uartRxRead != uartRxWrite) {
+#endif
+			rxData = uartRxBuffer[uartRxRead & UARTRXMASK];
+			rxErrors = uartRxError[uartRxRead & UARTRXMASK];
+			uartRxRead++;
+			TRACE(TRACE_RX | rxErrors, rxData);
+
+			// Timeout runs from the first byte of a query
+			if(!matchDepth) rxTimeout = protocol.timeout;
+			rxGap = protocol.gap;
+			matchDepth++;
+			step = 1;
+			LEARN_BYTE(rxData, rxErrors, matchDepth);
+
+#ifdef COUNTERS
+			if(rxErrors & RX_PARITY_ERROR) count(COUNT_PARITY);
+			if(rxErrors & RX_FRAMING_ERROR) count(COUNT_FRAMING);
+
+			// Diagnostic query is followed from the first byte of a query
+			if(!rxErrors && diagDepth == matchDepth - 1 && rxData == pgm_read_byte(&diagQuery[diagDepth]))
+				diagDepth++;
+#endif
+			matchPending = 1;
+		} else if(!step && matchPending) {
+			matchPending = 0;
+			step = 1;
+
+			// Corrupted byte never matches, so no reply is sent to a
+			// query that was not received right
+			if(rxErrors)
+				matchState = MATCH_DISCARD;
+			else if(matchState != MATCH_DISCARD)
+				matchState = matchByte(&protocol, matchState, rxData);
+
+			handled = 0;
+			if(matchState == MATCH_DISCARD) {
+				// Unknown, wait for its terminator or until no longer messages are expected
+				handled = ((!rxErrors && rxData == protocol.terminator) || matchDepth >= protocol.maxQuery);
+#ifdef COUNTERS
+				if(diagDepth == matchDepth) {
+					// Diagnostic query so far, it is not in the tables
+					handled = (diagDepth == DIAG_QUERY_LENGTH);
+					if(handled) diagLength = DIAG_REPLY_LENGTH;
+				} else
+#endif
+				if(handled) {
+					TRACE(TRACE_DROP, matchDepth);
+					COUNT(COUNT_UNKNOWN);
+					LEARN_UNKNOWN(matchDepth);
 				}
+			} else if((query = TABLE_BYTE(&protocol.matcher[matchState])) != MATCH_NO_QUERY) {
+				// All bytes match -> queue response, delay counts from now
+				replyQuery[replyWrite & REPLY_QUEUE_MASK] = query;
+				replyDue[replyWrite & REPLY_QUEUE_MASK] = tickCount + (TABLE_WORD(&protocol.replyDelay[query]) << delayShift);
+				replyWrite++;
+				handled = 1;
+				TRACE(TRACE_MATCH, query);
+				COUNT(COUNT_QUERY + query);
 			}
 
-			// Messages were checked
-			// Clear receive buffer if message was handled or no longer messages are expected
-			// Also clear the receive buffer if message has timeout'd
-			if(failed == 0 || !(failed & 0x02) || rxTimeout == 0) {
-				uartRxWrite = 0;
-				uartRxRead = 0;
+			// Message was handled or no longer messages are expected
+			if(handled) {
+				matchState = 0;
+				matchDepth = 0;
 				rxTimeout = 0;	// Ready for next messages that were not timeout'd before
+#ifdef COUNTERS
+				diagDepth = 0;
+#endif
 			}
 		}
+
+		// Start the next reply when it is due and the previous one is in
+		// the transmit buffer
+		if(!step && !length && replyRead != replyWrite &&
+		   (int16_t)(tickCount - replyDue[replyRead & REPLY_QUEUE_MASK]) >= 0) {
+			query = replyQuery[replyRead & REPLY_QUEUE_MASK];
+			replyRead++;
+			reply = &protocol.reply[TABLE_BYTE(&protocol.replyIndex[query])];
+			length = TABLE_BYTE(&protocol.replyIndex[query + 1]) - TABLE_BYTE(&protocol.replyIndex[query]);
+			if((uint8_t)(uartTxWrite - uartTxRead) + length > UARTTXSIZE)
+				COUNT(COUNT_TX_FULL);
+			step = 1;
+		}
+
+		// Append response to buffer, one frame per iteration
+		if(!step && length && (uint8_t)(uartTxWrite - uartTxRead) < UARTTXSIZE) {
+			uartTxBuffer[uartTxWrite & UARTTXMASK] = TABLE_WORD(reply++);
+			TRACE(TRACE_REPLY, uartTxBuffer[uartTxWrite & UARTTXMASK] >> 1);
+			uartTxWrite++;
+			length--;
+			step = 1;
+		}
+#ifdef COUNTERS
+		else if(!step && diagLength && replyRead == replyWrite && (uint8_t)(uartTxWrite - uartTxRead) < UARTTXSIZE) {
+			uartTxBuffer[uartTxWrite & UARTTXMASK] = uartFrame(diagByte(DIAG_REPLY_LENGTH - diagLength));
+			uartTxWrite++;
+			diagLength--;
+			step = 1;
+		}
+#endif
+
+#ifdef BACKGROUND
+		// Slow work is left to a tick without another long step, one
+		// of them at a time
+		background = !step;
+#endif
+#ifndef USI_UART
+		// Measure the last frame and adjust the clock
+		if(background && calibState != CALIB_IDLE) {
+			calibTask();
+			background = 0;
+		}
+#endif
+#ifdef STACK_CHECK
+		if(background && (tickCount & 1)) {
+			stackCheck();
+			background = 0;
+		}
+#endif
+#ifdef LEARN
+		if(background) learnTask();
+#endif
+
+#ifdef DEBUG_TIMING
+		timingRecord(ticks);
+#endif
 	}
 }
 
 
 
-// This routine handles the OSRAM serial communication
-// TODO: To be implemented
-void osramLoop(void)
+#ifdef AUTO_SERIAL
+// Serial protocol detection
+// Both protocols use the same framing, so the bit rate tells them
+// apart. Waits for the projector to talk and measures the pulses on RX
+// with timer 0 at CLK / 256 = 32 us: bit is 13 counts at 2400 baud and
+// 3.3 counts at 9600 baud. Every frame has pulses of one or two bits,
+// so the shortest of the first pulses is below the threshold only at
+// 9600 baud. Longer pulses than a 2400 baud frame are idle time and
+// pulses shorter than most of a 9600 baud bit are glitches. A glitch
+// inside a pulse would split it in two short ones, so the glitch and
+// the pulses on both sides of it are measured as one.
+// Detection ends inside a frame, so the UART is only started after the
+// line was high for a frame time at the detected rate: the next falling
+// edge is a start bit. A line that is never idle that long starts the
+// UART after AUTO_SETTLE anyway.
+// Runs before interrupts are enabled, the first query is lost.
+#define AUTO_PULSES		6	// Pulses measured
+#define AUTO_THRESHOLD		10	// Shortest pulse below this is 9600 baud
+#define AUTO_IDLE		143	// 11 bits at 2400 baud
+#define AUTO_IDLE_OSRAM		36	// 11 bits at 9600 baud
+#define AUTO_GLITCH		3	// 96 us
+#define AUTO_SETTLE		31250	// 1 s
+
+static mode_t autoDetect(void)
 {
-	while(1)
-	{
-		;
+	uint16_t time = 0, lastEdge = 0, width;
+	uint16_t pending = 0;	// Last pulse, counted once it is known not to end in a glitch
+	uint16_t merged = 0;	// Pulse and glitch before the current pulse
+	uint8_t now, previous = 0, level, lastLevel = RXPIN;
+	uint8_t pulses = 0, shortest = 0xFF, started = 0;
+	uint16_t idle, settle;
+
+	TCCR0A = 0;
+	TCNT0 = 0;
+	TCCR0B = (1 << CS02);
+
+	while(pulses < AUTO_PULSES) {
+		SIM_WAIT();
+
+		// Extend timer to 16 bits, loop is much faster than a count
+		now = TCNT0;
+		if(now < previous) time += 0x100;
+		previous = now;
+
+		level = PINB & RXPIN;
+		if(level == lastLevel) continue;
+		width = (time | now) - lastEdge;
+		lastEdge = time | now;
+		lastLevel = level;
+
+		// Measure from the first falling edge on
+		if(!started) {
+			started = !level;
+			continue;
+		}
+		if(width < AUTO_GLITCH) {
+			merged = pending + width;
+			pending = 0;
+			continue;
+		}
+		width += merged;
+		merged = 0;
+
+		if(pending && pending < AUTO_IDLE) {
+			pulses++;
+			if(pending < shortest) shortest = pending;
+		}
+		pending = width;
+	}
+
+	// Wait for the end of the frame and the idle line after it
+	idle = (shortest < AUTO_THRESHOLD) ? AUTO_IDLE_OSRAM : AUTO_IDLE;
+	settle = lastEdge;
+	while(!lastLevel || (uint16_t)((time | now) - lastEdge) < idle) {
+		SIM_WAIT();
+
+		now = TCNT0;
+		if(now < previous) time += 0x100;
+		previous = now;
+
+		if((uint16_t)((time | now) - settle) > AUTO_SETTLE) break;
+		level = PINB & RXPIN;
+		if(level == lastLevel) continue;
+		lastEdge = time | now;
+		lastLevel = level;
 	}
+
+	TCCR0B = 0;
+	return (shortest < AUTO_THRESHOLD) ? OSRAM : USHIO;
 }
+#endif
 
 // This routine handles the simple lamp on / dim / flag communication scheme
+// Pin change interrupt does all the work, so just sleep between the edges.
+// Pin change wakes the core also from power-down, and internal RC
+// starts in 6 clock cycles so the flag follows Sync within few microseconds
+// With FLAG_PWM the timers run, so the core sleeps in idle mode instead
 void flagLoop(void)
 {
-	uint8_t pin_status = 0;
-	uint8_t lamp_on = 0;
-	uint8_t dim_on = 0;
+	TIMSK = 0;
+	TCCR1 = 0;
+	ACSR = (1 << ACD);		// Analog comparator off
+#ifdef FLAG_PWM
+	// Timer 1 at CLK / 8 counts to 255, 3.9 kHz PWM
+	PRR = (1 << PRUSI) | (1 << PRADC);
+	OCR1C = 255;
+	TCCR1 = (1 << CS12);
+	TCCR0A = 0;
+	TCCR0B = FLAG_DIM_PRESCALER;
+	TIFR = (1 << TOV0);
+	TIMSK = (1 << TOIE0);
+	PORTB &= ~FLAG_PWM_PIN;		// Pull-up off, lamp is off
+	DDRB |= FLAG_PWM_PIN;
+#else
+	// Nothing is clocked in this mode
+	PRR = (1 << PRTIM1) | (1 << PRTIM0) | (1 << PRUSI) | (1 << PRADC);
+#endif
+
+	// Set the initial state, after that only changes are handled
+	cli();
+	flagUpdate();
+	PCMSK = RXPIN | SYNCPIN;
+	GIFR = (1 << PCIF);
+	GIMSK = (1 << PCIE);
 
+#ifdef FLAG_PWM
+	set_sleep_mode(SLEEP_MODE_IDLE);
+#else
+	set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+#endif
 	while(1)
 	{
-		// Wait for timer, just to not run as fast as possible
-		while(!timerTriggered);
-		timerTriggered = 0;
+#ifdef FLAG_PWM
+		flagPwmUpdate();
+		cli();
+#endif
+		// Interrupts are enabled only right before sleep
+		// so that the wake-up edge is not missed
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+	}
+}
 
-		pin_status = PINB;
+// Start the timers and the reception of the mode
+// Timer 0 is left stopped in 3-wire mode
+static void timerStart(mode_t mode)
+{
+	TCCR1 = 0;		// Stop the timer
+	TCNT1 = 0;		// Preset timer value to 0
+	GTCCR = (1 << PSR1);	// Reset the prescaler
+	TIMSK = (1 << OCIE1A);	// Enable interrupt on compare 0A match
 
-		// Check DIM/RXD; if pin is low, then dim the lamp
-		if(!(pin_status & RXPIN))  {
-			dim_on = 1;
-		} else {
-			dim_on = 0;
-		}
+	// Configure timer
+	// For Osram 9600 baud this is 4 ticks/bit, for Ushio 2400 baud USHIO_TICKS ticks/bit
+	// Select the clock speed
+	// Timer counts from 0 to OCR1C, so the tick is OCR1C + 1 us
+	if(mode == OSRAM) {
+	        OCR1A = TICK_COUNTS(OSRAM_BAUD, OSRAM_TICKS) - 1;	// 26 us (9600 bps/4) for OSRAM
+	        OCR1C = TICK_COUNTS(OSRAM_BAUD, OSRAM_TICKS) - 1;
+	} else {
+	        OCR1A = TICK_COUNTS(USHIO_BAUD, USHIO_TICKS) - 1;	// 104 us (2400 bps/4) for others
+	        OCR1C = TICK_COUNTS(USHIO_BAUD, USHIO_TICKS) - 1;
+	}
 
-		// Check SCI/Sync
-		// If pin is low, turn lamp ON
-		// Flag follows the request to turn on the light immediately
-		if(!(pin_status & SYNCPIN))
-		{
-			lamp_on = 1;
-			PORTB |= TXPIN;
-		} else {
-			lamp_on = 0;
-			PORTB &= ~TXPIN;
-		}
+        // Start the timer in compare output mode
+        // PLLCSR = (1 << PLLE) | (1 << PLOCK);
+        TCCR1 = (1 << CTC1) | (1 << CS12);   // Prescaler, tick is CLK / 8 = 1 MHz
 
+	if(mode == USHIO || mode == OSRAM) {
+#ifdef USI_UART
+		usiInit(mode == OSRAM ? USI_BIT_COUNTS(OSRAM_BAUD) : USI_BIT_COUNTS(USHIO_BAUD));
+#else
+		// Timer 0 runs freely for the oscillator calibration
+		calibLoad();
+		TCCR0A = 0;
+		TCCR0B = (mode == OSRAM) ? CALIB_PRESCALER_OSRAM : CALIB_PRESCALER_USHIO;
+
+		// Start bit detection with pin change interrupt
+		// Data edges are time stamped too, see rxStartBit()
+		PCMSK = RXPIN;
+		GIMSK = (1 << PCIE);
+		TIMSK |= (1 << OCIE1B);		// RX tick
+#endif
 	}
 }
 
+#ifndef MODE
+// Stop the timers and the reception started for the wrong mode
+// A frame started meanwhile is dropped, the projector repeats it
+static void timerStop(void)
+{
+	cli();
+	GIMSK = 0;
+	TIMSK = 0;
+	TCCR1 = 0;
+	TIFR = (1 << OCF1A) | (1 << OCF1B);
+#ifdef USI_UART
+	usiStop();
+#else
+	TCCR0B = 0;
+	rxInFrame = 0;
+	rxStartEdge = 0;
+	GIFR = (1 << PCIF);
+#endif
+	PCMSK = 0;
+	timerTriggered = 0;
+}
+#endif
+
 /**
  * Main function
  *
  */
 int main(void)
 {
+#ifndef MODE
 	uint8_t modeBits = 0;
-
-	// Default mode
-	mode_t operationMode = DEAD;
+#endif
 
 	// Set clock speed to 8 MHz
 	// By default the internal RC is 8 MHz
@@ -384,57 +2148,69 @@ int main(void)
 	// This is also needed to ensure USHIO mode if no external resistors on pins
 	PORTB = PULLUPS;
 
-	_delay_ms(1);	// Wait 1 ms to ensure pull-ups are stable
+#ifndef MODE
+	// Receive from the start, the projector may be sending already
+	// Open ID pins select Ushio, so capture at its rate while the pull-ups
+	// settle and restart only if the straps select another mode
+	timerStart(USHIO);
+	sei();
+	SIM_READY();
+
+	// Wait for the pull-ups to be stable. Open ID pin has only the pin
+	// capacitance (< 10 pF) on the pull-up, time constant below 0.5 us,
+	// and strapped pins are held by the resistor from the start
+	_delay_us(PULLUP_SETTLE_US);
 
 	// Read GPIO to determine operation mode
 	// ID0 sets the bit 0, ID1 sets bit 1
 	modeBits = PINB & (ID0 | ID1);
 	operationMode = ((modeBits & ID0) ? 0x01 : 0x00) | ((modeBits & ID1) ? 0x02 : 0x00);
+#ifndef AUTO_SERIAL
+	if(operationMode != USHIO)
+#endif
+		timerStop();
+#endif
 
 	// If operation mode is DEAD (e.g. for debugging with external
 	// hardware in the RX/TX pins, hang here)
 	// Also disable the pull-ups just in case
 	if(operationMode == DEAD) {
 		PORTB = 0x00;	// Disable pull-ups
+#ifdef DEBUG_TRACE
+		traceDump();	// Trace of the previous run to TX
+#endif
 		while(1);	// Stay, dog
 	}
 
 	// Set GPIO outputs on port B
 	// 1 = Output, so set only TXPIN
-	// PORTB is already 0 so output goes low without glitch
+	// Serial line idles high, so drive it high from the start or the
+	// projector sees a start bit. Flag starts low (lamp off).
+	if(operationMode != FLAG) PORTB |= TXPIN;
 	DDRB = OUTPUTPINS;
 
-	// Configure timer
-	// For Osram 9600 baud this is 4 ticks/bit, for Ushio 2400 baud 16 ticks/bit
-        TCCR1 = 0;		// Reset timer value
-        TCNT1 = 0;		// Preset timer value to 0
-        GTCCR = (1 << PSR1);	// Reset the prescaler
-
-	// Select the clock speed
-	if(operationMode == OSRAM) {
-	        OCR1A = 26;		// 26 us (9600 bps/4) for OSRAM
-	        OCR1C = 26;
-	} else {
-	        OCR1A = 104;		// 104 us (2400 bps/4) for others
-	        OCR1C = 104;
-	}
-
-        TIMSK = (1 << OCIE1A);	// Enable interrupt on compare 0A match
+#ifdef AUTO_SERIAL
+	// No straps, find out which protocol the projector talks
+	if(operationMode == USHIO)
+		operationMode = autoDetect();
+#endif
 
-        // Start the timer in compare output mode
-        // PLLCSR = (1 << PLLE) | (1 << PLOCK);
-        TCCR1 = (1 << CTC1) | (1 << CS12);   // Prescaler, tick is CLK / 8 = 1 MHz
+	// Timer 1 is still running if the straps selected Ushio
+	if(!(TCCR1 & 0x0F)) {
+		timerStart(operationMode);
 
-	// Enable global interrupts
-	sei();
+		// Enable global interrupts
+		sei();
+		SIM_READY();
+	}
 
 	// Select correct operation loop
 	switch(operationMode) {
 	case USHIO:
-		ushioLoop();
+		serialLoop(&ushioProtocol);
 		break;
 	case OSRAM:
-		osramLoop();
+		serialLoop(&osramProtocol);
 		break;
 	case FLAG:
 		flagLoop();
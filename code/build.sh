@@ -1,4 +1,51 @@
-avr-gcc -g -Os -mmcu=attiny85 -c $1.c
-avr-gcc -g -mmcu=attiny85 -o $1.elf $1.o
-avr-objcopy -j .text -j .data -O ihex $1.elf $1.hex
+# Builds $1.hex, which reads the mode straps at boot, and $1-ushio.hex,
+# $1-osram.hex and $1-flag.hex with the mode fixed at compile time,
+# and prints their flash and SRAM use
+# Usage: ./build.sh attiny-ballast
+# Default low fuse 0x62 holds reset 64 ms after power-up, 0x52 (SUT=01)
+# only 4 ms, see readme.md: avrdude -c linuxgpio -p t85 -U lfuse:w:0x52:m
+python3 gen-queries.py ushio-queries.txt ushio-queries.h USHIO
+python3 gen-queries.py osram-queries.txt osram-queries.h OSRAM
+# EEPROM images of the same tables for EEPROM_TABLE builds
+python3 gen-queries.py ushio-queries.txt ushio-table.eep USHIO
+python3 gen-queries.py osram-queries.txt osram-table.eep OSRAM
+
+# Unused functions and tables are left out of the image
+CFLAGS="-g -Os -mmcu=attiny85 -ffunction-sections -fdata-sections"
+LDFLAGS="-g -mmcu=attiny85 -Wl,--gc-sections"
+
+# build <output name> [compiler options]
+build() {
+	out=$1
+	shift
+	avr-gcc $CFLAGS "$@" -c $SRC.c -o $out.o || exit 1
+	avr-gcc $LDFLAGS -o $out.elf $out.o || exit 1
+	avr-objcopy -j .text -j .data -O ihex $out.elf $out.hex || exit 1
+}
+
+SRC=$1
+build $1
+for mode in USHIO OSRAM FLAG; do
+	build $1-$(echo $mode | tr A-Z a-z) -DMODE=$mode
+done
+avr-size $1.elf $1-ushio.elf $1-osram.elf $1-flag.elf
+
+# SRAM budget of each build: variables are fixed at link time, the rest
+# is left for the stack. STACK_CHECK in the firmware shows how much of that
+# is used, the warning is for less than STACK_MIN bytes.
+RAM_SIZE=512
+STACK_MIN=64
+echo
+printf "%-24s %6s %6s %7s %6s\n" "SRAM $RAM_SIZE bytes" data bss noinit stack
+for elf in $1.elf $1-ushio.elf $1-osram.elf $1-flag.elf; do
+	avr-size -A $elf | awk -v name=$elf -v ram=$RAM_SIZE -v min=$STACK_MIN '
+		$1 == ".data" { data = $2 }
+		$1 == ".bss" { bss = $2 }
+		$1 == ".noinit" { noinit = $2 }
+		END {
+			stack = ram - data - bss - noinit
+			printf "%-24s %6d %6d %7d %6d%s\n", name, data, bss, noinit, stack,
+				stack < min ? "  below " min : ""
+		}'
+done
 cp $1.hex demo.hex
@@ -0,0 +1,244 @@
+#!/usr/bin/env python3
+
+# gen-queries.py
+# Compiles the query/reply table (ushio-queries.txt) into a prefix
+# automaton for the firmware query matcher.
+# Output is a C header with the tables as initializer macros,
+# states and replies are packed variable length byte records
+# so that the firmware can keep them in flash. The root state is also
+# written as a 256 byte table indexed by the first byte of the query.
+# Duplicate queries are reported, the first one is used.
+#
+# Usage: gen-queries.py <table.txt> <output.h> [PREFIX]
+# PREFIX names the generated macros, default is USHIO, and selects the
+# bit rate that reply delays in us or ms are converted with
+#
+# With an output file ending in .eep the table is written instead as an
+# Intel hex EEPROM image for firmware built with EEPROM_TABLE, PREFIX
+# selects the mode the table is for:
+#   gen-queries.py ushio-queries.txt ushio-table.eep USHIO
+#   avrdude -c linuxgpio -p t85 -U eeprom:w:ushio-table.eep:i
+
+import sys
+
+def parse_bytes(text):
+   return [int(x, 16) for x in text.split()]
+
+# First byte of the diagnostic query 7E 44 0D, which the firmware answers
+# itself, so no query in the table may start with it
+DIAG_START = 0x7E
+
+# Bit rates for the reply delays, delay unit is 1/4 bit (4x tick)
+BAUD = {'USHIO': 2400, 'OSRAM': 9600}
+
+# Reply delay: <n>us, <n>ms or <n>ticks, ticks are 1/4 bits
+# Firmware compares tick counts as signed 16 bit values at up to 16 ticks
+# per bit, which limits the delay to 8191 ticks
+DELAY_MAX = 0x1FFF
+
+def parse_delay(text, baud):
+   text = text.strip()
+   for unit, scale in (('ticks', None), ('us', 1e-6), ('ms', 1e-3)):
+      if text.endswith(unit):
+         value = float(text[:-len(unit)])
+         ticks = value if scale is None else value * scale * baud * 4
+         ticks = int(round(ticks))
+         if not 0 <= ticks <= DELAY_MAX:
+            raise ValueError(text)
+         return ticks
+   raise ValueError(text)
+
+def read_table(filename, baud):
+   entries = []
+   for lineno, line in enumerate(open(filename), 1):
+      line = line.split('#', 1)[0].strip()
+      if not line:
+         continue
+      if ':' not in line:
+         sys.exit('{}:{}: expected "query : reply"'.format(filename, lineno))
+      query, reply = line.split(':', 1)
+      delay = 0
+      if '@' in reply:
+         reply, delay = reply.split('@', 1)
+         try:
+            delay = parse_delay(delay, baud)
+         except ValueError:
+            sys.exit('{}:{}: expected reply delay as <n>us, <n>ms or <n>ticks, at most {} ticks'.format(filename, lineno, DELAY_MAX))
+      query = parse_bytes(query)
+      reply = parse_bytes(reply)
+      if not query:
+         sys.exit('{}:{}: empty query'.format(filename, lineno))
+      if query[0] == DIAG_START:
+         sys.exit('{}:{}: query starts with 0x{:02X}, the first byte of the diagnostic query'.format(filename, lineno, DIAG_START))
+      entries.append((lineno, query, reply, delay))
+   return entries
+
+# Build the trie, states are numbered in breadth first order, root is 0
+# Each state is [edges {byte: state}, query number or None]
+def build_automaton(entries, filename):
+   queries = []		# Distinct queries in table order: (query, reply, delay)
+   lines = []		# Line of each distinct query
+   trie = [[{}, None]]
+   for lineno, query, reply, delay in entries:
+      state = 0
+      for depth, b in enumerate(query):
+         if trie[state][1] is not None:
+            sys.exit('{}:{}: query {} is never matched, shorter query {} matches first'.format(
+               filename, lineno, hexlist(query), hexlist(queries[trie[state][1]][0])))
+         if b not in trie[state][0]:
+            trie.append([{}, None])
+            trie[state][0][b] = len(trie) - 1
+         state = trie[state][0][b]
+      if trie[state][1] is not None:
+         # Same query already in table, first one wins
+         first = trie[state][1]
+         differs = ', with a different reply' if queries[first][1:] != (reply, delay) else ''
+         sys.stderr.write('{}:{}: warning: duplicate of query {} on line {}{}, ignored\n'.format(
+            filename, lineno, hexlist(query), lines[first], differs))
+         continue
+      if trie[state][0]:
+         sys.exit('{}:{}: query {} is a prefix of a longer query'.format(filename, lineno, hexlist(query)))
+      trie[state][1] = len(queries)
+      queries.append((query, reply, delay))
+      lines.append(lineno)
+
+   # Pack states breadth first into variable length records:
+   # matched query, number of transitions, {received byte, next state offset}
+   # State is identified by its offset, root is at offset 0
+   order = [0]
+   for s in order:
+      order.extend(trie[s][0][b] for b in sorted(trie[s][0]))
+   offset = {}
+   pos = 0
+   for s in order:
+      offset[s] = pos
+      pos += 2 + 2 * len(trie[s][0])
+
+   records = []
+   for s in order:
+      data = [trie[s][1], len(trie[s][0])]
+      for b in sorted(trie[s][0]):
+         data.extend([b, offset[trie[s][0][b]]])
+      records.append((offset[s], data))
+   return queries, records, pos
+
+# Serial frame of a byte, sent LSB first:
+# start (0), 8 data bits, even parity and stop (1)
+def frame(b):
+   parity = bin(b).count('1') & 1
+   return (b << 1) | (parity << 9) | (1 << 10)
+
+def hexlist(data):
+   return ' '.join('0x{:02X}'.format(b) for b in data)
+
+def write_header(filename, source, prefix, queries, records, size):
+   out = []
+   out.append('// Generated by gen-queries.py from {}, do not edit'.format(source))
+   out.append('')
+   frames = sum(len(r) for q, r, d in queries)
+   out.append('#define {}_QUERIES\t\t{}\t// Number of distinct queries'.format(prefix, len(queries)))
+   out.append('#define {}_MAX_QUERY\t\t{}\t// Longest query'.format(prefix, max([len(q) for q, r, d in queries] + [0])))
+   out.append('#define {}_MATCHER_SIZE\t{}\t// Bytes in matcher table'.format(prefix, size))
+   out.append('#define {}_REPLY_SIZE\t{}\t// Frames in reply table'.format(prefix, max(frames, 1)))
+   last = set(q[-1] for q, r, d in queries)
+   if len(last) == 1:
+      out.append('#define {}_TERMINATOR\t0x{:02X}\t// Last byte of every query'.format(prefix, last.pop()))
+   else:
+      out.append('#define {}_TERMINATOR\tMATCH_NO_TERMINATOR\t// Queries do not end with the same byte'.format(prefix))
+   out.append('')
+   out.append('// Matcher states: matched query, number of transitions, {received byte, next state}')
+   out.append('#define {}_MATCHER_DATA {{ \\'.format(prefix))
+   for pos, data in records:
+      query = 'MATCH_NO_QUERY' if data[0] is None else str(data[0])
+      rest = ''.join(' 0x{:02X}, {},'.format(data[k], data[k + 1]) for k in range(2, len(data), 2))
+      out.append('\t{}, {},{}\t/* {} */ \\'.format(query, data[1], rest, pos))
+   out.append('\t}')
+   if queries:
+      # Root state as a table indexed by the first byte of the query
+      root = records[0][1]
+      dispatch = [0xFF] * 256
+      for k in range(2, len(root), 2):
+         dispatch[root[k]] = root[k + 1]
+      out.append('')
+      out.append('// Next state after the first byte of a query, 0xFF = MATCH_DISCARD')
+      out.append('#define {}_DISPATCH_DATA {{ \\'.format(prefix))
+      for row in range(0, 256, 16):
+         out.append('\t{},\t/* 0x{:02X} */ \\'.format(', '.join('0x{:02X}'.format(x) for x in dispatch[row:row + 16]), row))
+      out.append('\t}')
+   out.append('')
+   out.append('// Replies as 11-bit serial frames, shifted out LSB first')
+   out.append('#define {}_REPLY_DATA {{ \\'.format(prefix))
+   index = []
+   pos = 0
+   for query, reply, delay in queries:
+      index.append(pos)
+      pos += len(reply)
+      out.append('\t{},\t/* {} -> {} */ \\'.format(', '.join('0x{:03X}'.format(frame(b)) for b in reply), hexlist(query), hexlist(reply)))
+   index.append(pos)
+   if not frames:
+      out.append('\t0,\t/* No replies */ \\')
+   out.append('\t}')
+   out.append('')
+   out.append('// Start of each reply in reply data, reply n ends where n + 1 starts')
+   out.append('#define {}_REPLY_INDEX {{{}}}'.format(prefix, ', '.join(str(x) for x in index)))
+   out.append('')
+   out.append('// Reply delay of each query in 1/4 bits, last entry only pads an empty table')
+   out.append('#define {}_REPLY_DELAY {{{}}}'.format(prefix, ', '.join(str(d) for q, r, d in queries + [([], [], 0)])))
+   with open(filename, 'w') as f:
+      f.write('\n'.join(out) + '\n')
+
+# EEPROM table, see EEPROM_TABLE in attiny-ballast.c
+TABLE_SIZE = 128
+TABLE_ADDRESS = 512 - TABLE_SIZE
+TABLE_MAX_QUERIES = 16
+TABLE_MODES = {'OSRAM': 2, 'USHIO': 3}
+
+def table_image(filename, prefix, queries, records, size):
+   if prefix not in TABLE_MODES:
+      sys.exit('{}: EEPROM table is only for {}'.format(filename, ', '.join(sorted(TABLE_MODES))))
+   matcher = []
+   for pos, data in records:
+      matcher.append(0xFF if data[0] is None else data[0])
+      matcher.extend(data[1:])
+   index = [0]
+   replies = []
+   delays = []
+   for query, reply, delay in queries:
+      delays.extend([delay & 0xFF, delay >> 8])
+      for b in reply:
+         f = frame(b)
+         replies.extend([f & 0xFF, f >> 8])
+      index.append(index[-1] + len(reply))
+   last = set(q[-1] for q, r, d in queries)
+   terminator = last.pop() if len(last) == 1 else 0x100
+   image = [ord('Q'), ord('T'), TABLE_MODES[prefix], max([len(q) for q, r, d in queries] + [0]),
+      terminator & 0xFF, terminator >> 8, len(queries), size, len(replies) // 2]
+   image += matcher + index + replies + delays
+   image.append(-sum(image) & 0xFF)
+   if len(queries) > TABLE_MAX_QUERIES or len(image) > TABLE_SIZE:
+      sys.exit('{}: table too large for EEPROM ({} bytes, {} queries)'.format(filename, len(image), len(queries)))
+   return image
+
+def write_ihex(filename, address, data):
+   out = []
+   for pos in range(0, len(data), 16):
+      chunk = data[pos:pos + 16]
+      record = [len(chunk), (address + pos) >> 8, (address + pos) & 0xFF, 0] + chunk
+      record.append(-sum(record) & 0xFF)
+      out.append(':' + ''.join('{:02X}'.format(b) for b in record))
+   out.append(':00000001FF')
+   with open(filename, 'w') as f:
+      f.write('\n'.join(out) + '\n')
+
+if len(sys.argv) not in (3, 4):
+   sys.exit('Usage: {} <table.txt> <output.h> [PREFIX]'.format(sys.argv[0]))
+prefix = sys.argv[3] if len(sys.argv) == 4 else 'USHIO'
+
+entries = read_table(sys.argv[1], BAUD.get(prefix, BAUD['USHIO']))
+queries, records, size = build_automaton(entries, sys.argv[1])
+if size > 255 or sum(len(r) for q, r, d in queries) > 255 or len(queries) > 254:
+   sys.exit('{}: table too large for 8-bit matcher'.format(sys.argv[1]))
+if sys.argv[2].endswith('.eep'):
+   write_ihex(sys.argv[2], TABLE_ADDRESS, table_image(sys.argv[1], prefix, queries, records, size))
+else:
+   write_header(sys.argv[2], sys.argv[1], prefix, queries, records, size)
@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+
+# learn-read.py
+# Lists the queries stored by the firmware learn mode (LEARN) from an
+# EEPROM image, in the format of ushio-queries.txt so that the lines can
+# be completed with the replies and copied to the table.
+# Read the EEPROM with e.g.
+#   avrdude -c linuxgpio -p t85 -U eeprom:r:eeprom.bin:r
+# Raw binary and Intel hex images are accepted.
+#
+# Usage: learn-read.py -e <firmware.elf> | -a <address> <eeprom.bin|eeprom.hex>
+# The table is at eeLearn, which the linker places: -e reads its address
+# from the firmware the EEPROM was written by with avr-nm, -a gives it
+# directly (e.g. -a 0x20). The magic must be at that address.
+# Layout must match learnTable_t in attiny-ballast.c
+
+import getopt
+import subprocess
+import sys
+
+LEARN_ENTRIES = 24
+LEARN_QUERY_MAX = 8
+LEARN_FREE = 0xFF
+ENTRY_SIZE = LEARN_QUERY_MAX + 3	# query, count (2), length
+MAGIC = b'LQ'
+
+def read_image(filename):
+   data = open(filename, 'rb').read()
+   if not data.startswith(b':'):
+      return bytearray(data)
+
+   # Intel hex, only data records are used
+   image = bytearray([0xFF] * 512)
+   for line in data.decode('ascii').split():
+      record = bytes.fromhex(line[1:])
+      length, address, kind = record[0], (record[1] << 8) | record[2], record[3]
+      if kind == 0:
+         end = address + length
+         if end > len(image):
+            image.extend([0xFF] * (end - len(image)))
+         image[address:end] = record[4:4 + length]
+   return image
+
+# EEPROM variables are linked at 0x810000 and up
+EEPROM_BASE = 0x810000
+
+def symbol_address(elf, name):
+   try:
+      out = subprocess.run(['avr-nm', elf], stdout=subprocess.PIPE, check=True,
+         universal_newlines=True).stdout
+   except (OSError, subprocess.CalledProcessError) as e:
+      sys.exit('{}: avr-nm failed: {}'.format(elf, e))
+   for line in out.splitlines():
+      fields = line.split()
+      if len(fields) == 3 and fields[2] == name:
+         return int(fields[0], 16) - EEPROM_BASE
+   sys.exit('{}: no {}, not built with LEARN?'.format(elf, name))
+
+def hexlist(data):
+   return ' '.join('{:02X}'.format(b) for b in data)
+
+try:
+   opts, args = getopt.getopt(sys.argv[1:], 'a:e:')
+except getopt.GetoptError:
+   opts, args = [], []
+opts = dict(opts)
+if len(args) != 1 or ('-a' in opts) == ('-e' in opts):
+   sys.exit('Usage: {} -e <firmware.elf> | -a <address> <eeprom.bin|eeprom.hex>'.format(sys.argv[0]))
+filename = args[0]
+
+start = int(opts['-a'], 0) if '-a' in opts else symbol_address(opts['-e'], 'eeLearn')
+image = read_image(filename)
+if image[start:start + len(MAGIC)] != MAGIC:
+   sys.exit('{}: no learned queries at 0x{:03X}'.format(filename, start))
+start += len(MAGIC)
+
+print('# Learned by learn-read.py from {}, add the replies'.format(filename))
+print('# Hits are counted when flushed, queries seen since are not included')
+for n in range(LEARN_ENTRIES):
+   entry = image[start + n * ENTRY_SIZE:start + (n + 1) * ENTRY_SIZE]
+   if len(entry) < ENTRY_SIZE:
+      break
+   length = entry[ENTRY_SIZE - 1]
+   if length == LEARN_FREE:
+      break
+   count = entry[LEARN_QUERY_MAX] | (entry[LEARN_QUERY_MAX + 1] << 8)
+   query = entry[:min(length, LEARN_QUERY_MAX)]
+   note = ', may be truncated' if length >= LEARN_QUERY_MAX else ''
+   print('{}\t:\t\t# seen {} times{}'.format(hexlist(query), count, note))
@@ -0,0 +1,23 @@
+// Generated by gen-queries.py from osram-queries.txt, do not edit
+
+#define OSRAM_QUERIES		0	// Number of distinct queries
+#define OSRAM_MAX_QUERY		0	// Longest query
+#define OSRAM_MATCHER_SIZE	2	// Bytes in matcher table
+#define OSRAM_REPLY_SIZE	1	// Frames in reply table
+#define OSRAM_TERMINATOR	MATCH_NO_TERMINATOR	// Queries do not end with the same byte
+
+// Matcher states: matched query, number of transitions, {received byte, next state}
+#define OSRAM_MATCHER_DATA { \
+	MATCH_NO_QUERY, 0,	/* 0 */ \
+	}
+
+// Replies as 11-bit serial frames, shifted out LSB first
+#define OSRAM_REPLY_DATA { \
+	0,	/* No replies */ \
+	}
+
+// Start of each reply in reply data, reply n ends where n + 1 starts
+#define OSRAM_REPLY_INDEX {0}
+
+// Reply delay of each query in 1/4 bits, last entry only pads an empty table
+#define OSRAM_REPLY_DELAY {0}
@@ -1,47 +1,254 @@
-#!/usr/bin/env python
-
-# serial-read.pu
-# Reads the ballast emulator responses to queries from serial-send.py
-# Uses pigpio software UART to allow using any pin as UART
-# Serial format is 2400 baud, 8 data bits, even parity
+#!/usr/bin/env python3
 
+# serial-read.py
+# Captures the ballast emulator serial lines with microsecond time stamps
+# pigpio reports every edge of the captured pins with its time stamp
+# through its notification pipe, and the frames are decoded here from
+# the edges, so nothing is lost between reads and replies that follow
+# each other closely are told apart.
+# Serial format is 2400 baud, 8 data bits, even parity, 1 stop bit
+#
+# Usage: serial-read.py [-b baud] [-g gpio,...] [-f us] [-o log.csv|log.bin]
+#        serial-read.py -d log.bin
+# Default is GPIO 25 (emulator TX, programming interface MISO), add 24
+# (MOSI) to log the queries sent by serial-send.py too. -f sets the pigpio
+# glitch filter, -d prints a binary log as CSV.
+#
+# Log has one record per byte: time in us from the start of the capture
+# (first edge of start bit), GPIO, byte and errors (P parity, F framing).
+# CSV by default, binary when the file name ends with .bin: "BLG1",
+# baud (32 bits), then 11 bytes per byte, LSB first: time (64 bits),
+# GPIO, byte, errors (1 parity, 2 framing). Log is flushed every second,
+# so long captures can be stopped with Ctrl-C at any time.
+#
 # Lauri Peltonen, 2018
 
-# Modified dramatically from https://raspberrypi.stackexchange.com/questions/27488/pigpio-library-example-for-bit-banging-a-uart
-# Original license:
-# bb_serial.py
-# 2014-12-23
-# Public Domain
-
+import queue
+import struct
+import sys
 import time
-import pigpio
 
-# Raspberry PI pin to use for reading, same as the programming interface MISO
+# Raspberry PI pins, same as the programming interface MISO and MOSI
 RX = 25
+TX = 24
+
+BAUD = 2400
+WATCHDOG_MS = 20	# Idle line is reported this often, ends the last frame
+
+PARITY_ERROR = 1
+FRAMING_ERROR = 2
+
+LOG_MAGIC = b'BLG1'
+LOG_RECORD = struct.Struct('<QBBB')
+
+def parity(b):
+   return bin(b).count('1') & 1
+
+# UART receiver working on edge time stamps, one per line
+# Frame is sampled at the bit centers from its start edge, like the
+# firmware does with its ticks. Frame is complete when the line is known
+# up to the stop bit center: at the next edge or at a later time stamp.
+class FrameDecoder:
+   def __init__(self, baud):
+      self.bit = 1e6 / baud
+      self.level = 1
+      self.start = None
+      self.edges = []		# Edges in the current frame: (time, level)
+
+   # Level change at time, returns the completed frames
+   def edge(self, t, level):
+      frames = self.idle(t)
+      if level == self.level:
+         return frames
+      self.level = level
+      if self.start is None:
+         if not level:
+            self.start = t
+            self.edges = []
+      else:
+         self.edges.append((t, level))
+      return frames
+
+   # No edges until time t, returns the completed frame
+   def idle(self, t):
+      if self.start is None or t < self.start + 10.5 * self.bit:
+         return []
+      frame = 0
+      level = 0
+      k = 0
+      for b in range(11):
+         sample = self.start + (b + 0.5) * self.bit
+         while k < len(self.edges) and self.edges[k][0] <= sample:
+            level = self.edges[k][1]
+            k += 1
+         frame |= level << b
+      data = (frame >> 1) & 0xFF
+      errors = 0
+      if ((frame >> 9) & 1) != parity(data):
+         errors |= PARITY_ERROR
+      if not frame & 0x400:
+         errors |= FRAMING_ERROR
+      start = self.start
+      self.start = None
+      return [(start, data, errors)]
+
+def error_text(errors):
+   return ('P' if errors & PARITY_ERROR else '') + ('F' if errors & FRAMING_ERROR else '')
+
+# Log writer, CSV or binary by file name
+class LogWriter:
+   def __init__(self, filename, baud):
+      self.binary = filename is not None and filename.endswith('.bin')
+      if filename is None:
+         self.f = sys.stdout
+      else:
+         self.f = open(filename, 'wb' if self.binary else 'w')
+      if self.binary:
+         self.f.write(LOG_MAGIC + struct.pack('<I', baud))
+      else:
+         self.f.write('time_us,gpio,byte,errors\n')
+
+   def write(self, t, gpio, data, errors):
+      if self.binary:
+         self.f.write(LOG_RECORD.pack(t, gpio, data, errors))
+      else:
+         self.f.write('{},{},0x{:02X},{}\n'.format(t, gpio, data, error_text(errors)))
+
+   def flush(self):
+      self.f.flush()
+
+   def close(self):
+      if self.f is not sys.stdout:
+         self.f.close()
+
+# Read a log written by LogWriter, yields (time, gpio, byte, errors)
+def read_log(filename):
+   if filename.endswith('.bin'):
+      with open(filename, 'rb') as f:
+         if f.read(4) != LOG_MAGIC:
+            sys.exit('{}: not a capture log'.format(filename))
+         f.read(4)
+         while True:
+            record = f.read(LOG_RECORD.size)
+            if len(record) < LOG_RECORD.size:
+               break
+            yield LOG_RECORD.unpack(record)
+   else:
+      with open(filename) as f:
+         f.readline()
+         for line in f:
+            t, gpio, data, errors = line.strip().split(',')
+            yield (int(t), int(gpio), int(data, 16),
+               (PARITY_ERROR if 'P' in errors else 0) | (FRAMING_ERROR if 'F' in errors else 0))
+
+# Edge capture of the given pins with pigpio callbacks
+# Callbacks run in the pigpio thread and only queue the edges,
+# frames() decodes them. Time stamps are made 64-bit so that the
+# 32-bit pigpio tick may wrap during the capture (every 72 minutes).
+class Capture:
+   def __init__(self, pi, gpios, baud=BAUD, glitch=0):
+      import pigpio
+      self.pi = pi
+      self.events = queue.Queue()
+      self.decoders = {gpio: FrameDecoder(baud) for gpio in gpios}
+      self.last = None
+      self.high = 0
+      self.epoch = None
+      self.callbacks = []
+      for gpio in gpios:
+         if gpio != TX:
+            pi.set_mode(gpio, pigpio.INPUT)	# serial-send.py drives TX
+         if glitch:
+            pi.set_glitch_filter(gpio, glitch)
+         self.decoders[gpio].level = pi.read(gpio)
+         self.callbacks.append(pi.callback(gpio, pigpio.EITHER_EDGE, self._edge))
+         pi.set_watchdog(gpio, WATCHDOG_MS)
+
+   def _edge(self, gpio, level, tick):
+      self.events.put((gpio, level, tick))
+
+   # Time stamp in us from the pigpio tick, 0 is the first event
+   def time(self, tick):
+      if self.last is not None and tick < self.last:
+         self.high += 1 << 32
+      self.last = tick
+      t = self.high + tick
+      if self.epoch is None:
+         self.epoch = t
+      return t - self.epoch
 
-baud = 2400
-bits = 9
+   # Yields the decoded frames as (time, gpio, byte, errors), checks
+   # stop() every timeout seconds
+   def frames(self, timeout=0.1):
+      self.running = True
+      while self.running:
+         try:
+            gpio, level, tick = self.events.get(timeout=timeout)
+         except queue.Empty:
+            continue
+         t = self.time(tick)
+         decoder = self.decoders[gpio]
+         if level == 2:
+            found = decoder.idle(t)		# Watchdog, no edges
+         else:
+            found = decoder.edge(t, level)
+         for start, data, errors in found:
+            yield (start, gpio, data, errors)
 
-pi = pigpio.pi()
+   def stop(self):
+      self.running = False
 
-# fatal exceptions off (so that closing an unopened gpio doesn't error)
-pigpio.exceptions = False
-pi.bb_serial_read_close(RX)
+   def close(self):
+      for gpio in self.decoders:
+         self.pi.set_watchdog(gpio, 0)
+      for cb in self.callbacks:
+         cb.cancel()
 
-# fatal exceptions on
-pigpio.exceptions = True
+def main():
+   import getopt
+   import pigpio
 
-# open a gpio to bit bang read the echoed data
-pi.bb_serial_read_open(RX, baud, bits)
+   try:
+      opts, args = getopt.getopt(sys.argv[1:], 'b:g:f:o:d:')
+   except getopt.GetoptError:
+      opts, args = [], [None]
+   opts = dict(opts)
+   if args:
+      sys.exit('Usage: {} [-b baud] [-g gpio,...] [-f us] [-o log.csv|log.bin] | -d log.bin'.format(sys.argv[0]))
 
-while 1:
-   (count, data) = pi.bb_serial_read(RX)
-   if count > 0:
-      # Print received data in HEX
-      print '[{}]'.format(', '.join(hex(x) for x in data))
+   if '-d' in opts:
+      out = LogWriter(None, 0)
+      for record in read_log(opts['-d']):
+         out.write(*record)
+      return
 
-   time.sleep(0.1) # enough time to ensure more data
+   baud = int(opts.get('-b', BAUD))
+   gpios = [int(x) for x in opts.get('-g', str(RX)).split(',')]
+   out = LogWriter(opts.get('-o'), baud)
+   counts = {gpio: [0, 0] for gpio in gpios}
 
+   pi = pigpio.pi()
+   if not pi.connected:
+      sys.exit('pigpiod is not running')
+   capture = Capture(pi, gpios, baud, int(opts.get('-f', 0)))
+   flushed = time.time()
+   try:
+      for t, gpio, data, errors in capture.frames():
+         out.write(t, gpio, data, errors)
+         counts[gpio][0] += 1
+         if errors:
+            counts[gpio][1] += 1
+         if time.time() - flushed >= 1:
+            out.flush()
+            flushed = time.time()
+   except KeyboardInterrupt:
+      pass
+   finally:
+      capture.close()
+      pi.stop()
+      out.close()
+   for gpio in gpios:
+      sys.stderr.write('GPIO {}: {} bytes, {} with errors\n'.format(gpio, counts[gpio][0], counts[gpio][1]))
 
-pi.bb_serial_read_close(RX)
-pi.stop()
+if __name__ == '__main__':
+   main()
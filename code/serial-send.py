@@ -1,10 +1,31 @@
-#!/usr/bin/env python
+#!/usr/bin/env python3
 
 # serial-send.py
 # Emulates projector and sends queries to the ballast emulator
-# Uses pigpio software UART to allow using any pin as UART
+# Uses pigpio waveforms to allow using any pin as UART
 # Serial format is 2400 baud, 8 data bits, even parity
-
+#
+# Usage: serial-send.py
+#        serial-send.py bench [-n queries] [-g min,max] [-k skew] [-e errors]
+#                       [-t table] [-w window] [-r report] [-s seed]
+# Without arguments sends the next query of the table at each Enter.
+#
+# bench sends the queries of the table in random order as a continuous
+# waveform and pairs each one with the reply captured by serial-read.py
+# on GPIO 25, the queries themselves are captured on GPIO 24 so that
+# both have the same time base:
+#   -n  queries to send, 0 runs until Ctrl-C (soak test), default 1000
+#   -g  random idle time between queries in ms, default 0 (line rate)
+#   -k  random baud error of each query within +-skew %, default 0
+#   -e  fraction of queries sent with a wrong parity bit, default 0,
+#       those must not be answered
+#   -t  query table, default ushio-queries.txt
+#   -w  longest accepted reply latency in ms, default 500
+#   -r  report every this many queries, default 1000
+# Report has the success rate, reply latency percentiles from the stop
+# bit center of the query to the start of the reply, queries without a
+# reply or with a wrong one and reply bytes that belong to no query.
+#
 # Lauri Peltonen, 2018
 
 # Modified dramatically from https://raspberrypi.stackexchange.com/questions/27488/pigpio-library-example-for-bit-banging-a-uart
@@ -13,68 +34,259 @@
 # 2014-12-23
 # Public Domain
 
+import importlib.util
+import os
+import random
+import sys
+import threading
+import time
 
 import pigpio
 
 # Raspberry PI transmit pin, same as the programming interface MOSI
 TX = 24
+# Receive pin for the benchmark, same as the programming interface MISO
+RX = 25
 
 # 2400 baud, 8 data bits, 1 even parity bit (bits in data is odd => parity is even), 1 stop bit
 baud = 2400
 bits = 9
 
-# Calculate parity
-# from http://p-nand-q.com/python/algorithms/math/bit-parity.html
-def parallel_swar(i):
-    i = i - ((i >> 1) & 0x55555555)
-    i = (i & 0x33333333) + ((i >> 2) & 0x33333333)
-    i = (((i + (i >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24
-    return int(i % 2)
-
-parity_lookup = [parallel_swar(i) for i in range(256)]
+BATCH = 32		# Queries per waveform
 
 def parity(v):
-    v ^= v >> 16
-    v ^= v >> 8
-    return parity_lookup[v & 0xff]
+   return bin(v).count('1') & 1
 
-# initialize test data
-msg_orig = [[0x4C, 0x46, 0x0D], [0x51, 0x0D], [0x50,0x0D], [0x4c, 0x45, 0x0D]]
-current = 0
-messages = len(msg_orig)
+# Data for wave_add_serial: 9-bit characters as 16-bit words, LSB first
+# Parity bit is inverted for a bad query
+def serial_data(query, bad=False):
+   msg = []
+   for b in query:
+      msg.append(b)
+      msg.append(parity(b) ^ (1 if bad else 0))
+   return msg
 
-pi = pigpio.pi()
-pi.set_mode(TX, pigpio.OUTPUT)
+# Query table, same format as gen-queries.py, first of duplicates wins
+def read_table(filename):
+   table = []
+   for line in open(filename):
+      line = line.split('#', 1)[0].split('@', 1)[0]
+      if ':' not in line:
+         continue
+      query, reply = line.split(':', 1)
+      query = [int(x, 16) for x in query.split()]
+      reply = [int(x, 16) for x in reply.split()]
+      if query and query not in [q for q, r in table]:
+         table.append((query, reply))
+   return table
 
-# fatal exceptions on
-pigpio.exceptions = True
+def interactive(pi):
+   # initialize test data
+   msg_orig = [[0x4C, 0x46, 0x0D], [0x51, 0x0D], [0x50,0x0D], [0x4c, 0x45, 0x0D]]
+   current = 0
+   wid = None
 
+   while 1:	# Replaced runtime-thing with this
+      input("Send bytes")
 
-while 1:	# Replaced runtime-thing with this
-   raw_input("Send bytes")
+      # Create the serial waveform
+      msg = serial_data(msg_orig[current])
 
-   # Create the serial waveform
-   msg = []
-   # Append parity bits
-   for i in range(len(msg_orig[current])):
-      msg.append(msg_orig[current][i])
-      msg.append(parity(msg_orig[current][i]))
+      # create a waveform representing the serial data
+      if wid is not None:
+         pi.wave_delete(wid)
+      pi.wave_clear()
+      pi.wave_add_serial(TX, baud, msg, bb_bits=bits)
+      wid = pi.wave_create()
+
+      pi.wave_send_once(wid)   # transmit serial data
+
+      print('[{}]'.format(', '.join(hex(x) for x in msg)))
+
+      while pi.wave_tx_busy(): # wait until all data sent
+         pass
+
+      current += 1
+      if current >= len(msg_orig):
+         current = 0
+
+# Pairs the sent queries with the captured frames, in order
+# Query ends at the stop bit center of its last byte. Reply is the first
+# bytes starting after that within the window, and it must start before
+# the next query ends unless replies are queued behind each other.
+class Scorer:
+   def __init__(self, window):
+      self.window = window		# us
+      self.sent = []			# (query, reply, bad, bit us)
+      self.queryFrames = []		# (time, byte, errors) on TX
+      self.replyFrames = []		# on RX
+      self.lock = threading.Lock()
+      self.next = 0			# Next query to score
+      self.queryPos = 0		# First frame of that query
+      self.replyPos = 0		# First reply frame not yet paired
+      self.latencies = []
+      self.ok = self.noReply = self.wrongReply = self.bad = self.extra = 0
+
+   def frame(self, t, gpio, data, errors):
+      with self.lock:
+         (self.queryFrames if gpio == TX else self.replyFrames).append((t, data, errors))
+
+   # End of query n with first frame at pos, inf if not yet captured
+   def end(self, n, pos):
+      query, reply, bad, bit = self.sent[n]
+      last = pos + len(query) - 1
+      if last >= len(self.queryFrames):
+         return float('inf')
+      return self.queryFrames[last][0] + 10.5 * bit
+
+   # Score the queries whose window has passed at time now
+   def score(self, now):
+      with self.lock:
+         while self.next < len(self.sent):
+            query, reply, bad, bit = self.sent[self.next]
+            end = self.end(self.next, self.queryPos)
+            if now < end + self.window:
+               break
+            self.next += 1
+            self.queryPos += len(query)
+
+            # Bytes of earlier replies are done, the rest up to here is extra
+            r = self.replyPos
+            while r < len(self.replyFrames) and self.replyFrames[r][0] < end:
+               r += 1
+            self.extra += r - self.replyPos
+            self.replyPos = r
+            if bad:
+               self.bad += 1
+               continue
+            if not reply:
+               continue
+
+            got = self.replyFrames[r:r + len(reply)]
+            if len(got) < len(reply) or got[0][0] > end + self.window:
+               self.noReply += 1
+            elif all(not e and d == b for (t, d, e), b in zip(got, reply)):
+               self.ok += 1
+               self.latencies.append(got[0][0] - end)
+               self.replyPos = r + len(reply)
+            elif self.next < len(self.sent) and got[0][0] > self.end(self.next, self.queryPos):
+               self.noReply += 1		# Reply of a later query, leave it to that
+            else:
+               self.wrongReply += 1
+               self.replyPos = r + len(reply)
+
+   def report(self):
+      expected = self.ok + self.noReply + self.wrongReply
+      line = '{} queries: {} ok ({:.2f} %), {} no reply, {} wrong reply, {} bad queries, {} extra bytes'.format(
+         self.next, self.ok, 100.0 * self.ok / expected if expected else 0,
+         self.noReply, self.wrongReply, self.bad, self.extra)
+      if self.latencies:
+         lat = sorted(self.latencies)
+         pick = lambda p: lat[min(len(lat) - 1, int(p * len(lat)))] / 1000.0
+         line += '\n   latency ms: min {:.2f}, 50 % {:.2f}, 90 % {:.2f}, 99 % {:.2f}, max {:.2f}'.format(
+            lat[0] / 1000.0, pick(0.5), pick(0.9), pick(0.99), lat[-1] / 1000.0)
+      print(line)
+      sys.stdout.flush()
+
+def bench(pi, args):
+   import getopt
+
+   opts, rest = getopt.getopt(args, 'n:g:k:e:t:w:r:s:')
+   if rest:
+      sys.exit('Usage: {} bench [-n queries] [-g min,max] [-k skew] [-e errors] [-t table] [-w window] [-r report] [-s seed]'.format(sys.argv[0]))
+   opts = dict(opts)
+   count = int(opts.get('-n', 1000))
+   gap = [float(x) * 1000 for x in opts.get('-g', '0').split(',')]
+   gap = (gap[0], gap[-1])
+   skew = float(opts.get('-k', 0)) / 100
+   errors = float(opts.get('-e', 0))
+   table = read_table(opts.get('-t', os.path.join(os.path.dirname(os.path.abspath(__file__)), 'ushio-queries.txt')))
+   every = int(opts.get('-r', 1000))
+   random.seed(int(opts.get('-s', 1)))
+   if not table:
+      sys.exit('No queries in table')
+
+   # Streaming reader from serial-read.py
+   spec = importlib.util.spec_from_file_location('serial_read',
+      os.path.join(os.path.dirname(os.path.abspath(__file__)), 'serial-read.py'))
+   reader = importlib.util.module_from_spec(spec)
+   spec.loader.exec_module(reader)
+
+   scorer = Scorer(float(opts.get('-w', 500)) * 1000)
+   capture = reader.Capture(pi, [TX, RX], baud)
+   captureTime = [0]
+
+   def receive():
+      for frame in capture.frames():
+         scorer.frame(*frame)
+         captureTime[0] = frame[0]
+   thread = threading.Thread(target=receive, daemon=True)
+   thread.start()
 
-   # create a waveform representing the serial data
+   # Waveforms are chained so that the line rate is kept between them,
+   # a wave is deleted once the next one is running
    pi.wave_clear()
-   pi.wave_add_serial(TX, baud, msg, bb_bits=bits)
-   wid=pi.wave_create()
+   waves = []
+   sent = 0
+   reported = 0
+   try:
+      while not count or sent < count:
+         offset = 0
+         for n in range(BATCH if not count else min(BATCH, count - sent)):
+            query, reply = random.choice(table)
+            bad = random.random() < errors
+            rate = baud * (1 + random.uniform(-skew, skew))
+            pi.wave_add_serial(TX, int(round(rate)), serial_data(query, bad), offset, bb_bits=bits)
+            scorer.sent.append((query, reply, bad, 1e6 / int(round(rate))))
+            offset += len(query) * 11 * 1e6 / int(round(rate)) + random.uniform(*gap)
+            sent += 1
+         # Idle time after the last query is part of the wave
+         pi.wave_add_generic([pigpio.pulse(0, 0, int(offset))])
+         wid = pi.wave_create()
+         pi.wave_send_using_mode(wid, pigpio.WAVE_MODE_ONE_SHOT_SYNC)
+         waves.append(wid)
+         while len(waves) > 1 and pi.wave_tx_at() != wid:
+            time.sleep(0.005)
+         while len(waves) > 1:
+            pi.wave_delete(waves.pop(0))
 
-   pi.wave_send_once(wid)   # transmit serial data
+         scorer.score(captureTime[0])
+         if scorer.next - reported >= every:
+            reported = scorer.next
+            scorer.report()
+      while pi.wave_tx_busy():
+         time.sleep(0.01)
+      time.sleep(scorer.window / 1e6 + 2 * reader.WATCHDOG_MS / 1000.0)
+   except KeyboardInterrupt:
+      pi.wave_tx_stop()		# Queries not captured on TX are not scored
+   capture.stop()
+   thread.join()
+   capture.close()
+   for wid in waves:
+      pi.wave_delete(wid)
+   scorer.score(float('inf'))
+   scorer.report()
 
-   print '[{}]'.format(', '.join(hex(x) for x in msg))
+def main():
+   pi = pigpio.pi()
+   if not pi.connected:
+      sys.exit('pigpiod is not running')
+   pi.set_mode(TX, pigpio.OUTPUT)
+   pi.write(TX, 1)	# Line idles high
 
-   while pi.wave_tx_busy(): # wait until all data sent
-      pass
+   # fatal exceptions on
+   pigpio.exceptions = True
 
-   current += 1
-   if current >= messages:
-      current = 0
+   try:
+      if len(sys.argv) > 1 and sys.argv[1] == 'bench':
+         bench(pi, sys.argv[2:])
+      elif len(sys.argv) > 1:
+         sys.exit('Usage: {} [bench [options]]'.format(sys.argv[0]))
+      else:
+         interactive(pi)
+   finally:
+      pi.wave_clear()
+      pi.stop()
 
-pi.wave_delete(wid)
-pi.stop()
+if __name__ == '__main__':
+   main()
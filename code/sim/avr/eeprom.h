@@ -0,0 +1,22 @@
+/**
+ * Host simulation stand-in for <avr/eeprom.h>
+ * EEPROM variables are ordinary memory, erased (0xFF) at startup
+ * by the simulator. Addresses up to E2END are EEPROM addresses, the
+ * simulator keeps those in an array. A write keeps the EEPROM busy for 3.4 ms, access
+ * while busy would stall the firmware and is counted by the simulator.
+ */
+#ifndef SIM_AVR_EEPROM_H
+#define SIM_AVR_EEPROM_H
+
+#include <stdint.h>
+
+uint8_t simEepromRead(const uint8_t *addr);
+void simEepromUpdate(uint8_t *addr, uint8_t value);
+int simEepromReady(void);
+
+#define EEMEM	__attribute__((section("sim_eeprom")))
+#define eeprom_read_byte(addr)		simEepromRead((const uint8_t *)(addr))
+#define eeprom_update_byte(addr, value)	simEepromUpdate((uint8_t *)(addr), (value))
+#define eeprom_is_ready()		simEepromReady()
+
+#endif
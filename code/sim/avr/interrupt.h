@@ -0,0 +1,27 @@
+/**
+ * Host simulation stand-in for <avr/interrupt.h>
+ *
+ * Interrupt handlers are plain functions which sim.c calls. All
+ * vectors are declared weak so that the simulator links also when
+ * the firmware build does not use some of them.
+ */
+#ifndef SIM_AVR_INTERRUPT_H
+#define SIM_AVR_INTERRUPT_H
+
+#define ISR(vector, ...)	void vector(void)
+#define ISR_NAKED
+#define reti()
+
+void simSei(void);
+void simCli(void);
+#define sei()		simSei()
+#define cli()		simCli()
+
+void PCINT0_vect(void) __attribute__((weak));
+void TIMER1_COMPA_vect(void) __attribute__((weak));
+void TIMER1_COMPB_vect(void) __attribute__((weak));
+void TIMER0_COMPA_vect(void) __attribute__((weak));
+void TIMER0_OVF_vect(void) __attribute__((weak));
+void USI_OVF_vect(void) __attribute__((weak));
+
+#endif
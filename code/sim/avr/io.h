@@ -0,0 +1,146 @@
+/**
+ * Host simulation stand-in for <avr/io.h>
+ *
+ * Attiny85 registers used by the firmware are plain variables,
+ * sim.c moves the timer and pins and dispatches the interrupts.
+ * Interrupt flag registers (TIFR, GIFR) are write-one-to-clear:
+ * the simulator keeps the real flags and clears those which the
+ * firmware writes as 1.
+ */
+#ifndef SIM_AVR_IO_H
+#define SIM_AVR_IO_H
+
+#include <stdint.h>
+
+extern volatile uint8_t PINB, PORTB, DDRB;
+extern volatile uint8_t TCCR1, TCNT1, OCR1A, OCR1B, OCR1C, GTCCR, TIMSK, TIFR;
+extern volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, OCR0B;
+extern volatile uint8_t USIDR, USIBR, USISR, USICR;
+extern volatile uint8_t GIMSK, PCMSK, GIFR, MCUCR, MCUSR, PRR, ACSR;
+extern volatile uint8_t OSCCAL, CLKPR, GPIOR0, GPIOR1, GPIOR2;
+extern volatile uint8_t EECR, EEDR, WDTCR;
+extern volatile uint16_t EEAR;
+
+#define RAMEND		0x25F
+#define E2END		0x1FF
+
+// Firmware calls this while it busy-waits for the timer
+void simWait(void);
+#define SIM_WAIT()	simWait()
+
+// Firmware calls this when it starts listening to RX
+void simReady(void);
+#define SIM_READY()	simReady()
+
+// Firmware calls this for every trace record, see TRACE()
+void simTrace(uint8_t type, uint8_t data);
+#define SIM_TRACE(type, data)	simTrace((type), (data))
+
+// CLKPR
+#define CLKPCE		7
+
+// TCCR1
+#define CTC1		7
+#define PWM1A		6
+#define COM1A1		5
+#define COM1A0		4
+#define CS13		3
+#define CS12		2
+#define CS11		1
+#define CS10		0
+
+// GTCCR
+#define TSM		7
+#define PWM1B		6
+#define COM1B1		5
+#define COM1B0		4
+#define FOC1B		3
+#define FOC1A		2
+#define PSR1		1
+#define PSR0		0
+
+// TIMSK, TIFR
+#define OCIE1A		6
+#define OCIE1B		5
+#define OCIE0A		4
+#define OCIE0B		3
+#define TOIE1		2
+#define TOIE0		1
+#define OCF1A		6
+#define OCF1B		5
+#define OCF0A		4
+#define OCF0B		3
+#define TOV1		2
+#define TOV0		1
+
+// TCCR0A, TCCR0B
+#define COM0A1		7
+#define COM0A0		6
+#define COM0B1		5
+#define COM0B0		4
+#define WGM01		1
+#define WGM00		0
+#define FOC0A		7
+#define FOC0B		6
+#define WGM02		3
+#define CS02		2
+#define CS01		1
+#define CS00		0
+
+// USISR, USICR
+#define USISIF		7
+#define USIOIF		6
+#define USIPF		5
+#define USIDC		4
+#define USICNT0		0
+#define USISIE		7
+#define USIOIE		6
+#define USIWM1		5
+#define USIWM0		4
+#define USICS1		3
+#define USICS0		2
+#define USICLK		1
+#define USITC		0
+
+// GIMSK, GIFR, PCMSK
+#define INT0		6
+#define PCIE		5
+#define INTF0		6
+#define PCIF		5
+#define PCINT0		0
+#define PCINT1		1
+#define PCINT2		2
+#define PCINT3		3
+#define PCINT4		4
+#define PCINT5		5
+
+// MCUCR, MCUSR
+#define BODS		7
+#define PUD		6
+#define SE		5
+#define SM1		4
+#define SM0		3
+#define BODSE		2
+#define ISC01		1
+#define ISC00		0
+#define WDRF		3
+#define BORF		2
+#define EXTRF		1
+#define PORF		0
+
+// PRR, ACSR
+#define PRTIM1		3
+#define PRTIM0		2
+#define PRUSI		1
+#define PRADC		0
+#define ACD		7
+
+// EECR
+#define EEPM1		5
+#define EEPM0		4
+#define EERIE		3
+#define EEMPE		2
+#define EEPE		1
+#define EERE		0
+
+#endif
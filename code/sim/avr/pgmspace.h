@@ -0,0 +1,16 @@
+/**
+ * Host simulation stand-in for <avr/pgmspace.h>
+ * Flash is ordinary memory on the host
+ */
+#ifndef SIM_AVR_PGMSPACE_H
+#define SIM_AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define pgm_read_byte(addr)	(*(const uint8_t *)(addr))
+#define pgm_read_word(addr)	(*(const uint16_t *)(addr))
+#define memcpy_P(dst, src, n)	memcpy((dst), (src), (n))
+
+#endif
@@ -0,0 +1,18 @@
+/**
+ * Host simulation stand-in for <avr/sleep.h>
+ * Sleeping runs the simulation until the next interrupt
+ */
+#ifndef SIM_AVR_SLEEP_H
+#define SIM_AVR_SLEEP_H
+
+#define SLEEP_MODE_IDLE		0
+#define SLEEP_MODE_ADC		1
+#define SLEEP_MODE_PWR_DOWN	2
+
+void simSleep(void);
+#define set_sleep_mode(mode)
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu()		simSleep()
+
+#endif
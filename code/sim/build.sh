@@ -0,0 +1,5 @@
+# Builds the host simulation of the firmware
+# Run from the code directory: sim/build.sh && sim/ballast-sim
+# Firmware options can be given, e.g. sim/build.sh -DUART_OVERSAMPLE=8
+cd "$(dirname "$0")"
+gcc -g -O2 -Wall -I. "$@" -o ballast-sim sim.c
@@ -0,0 +1,17 @@
+# Runs the scenarios on the default firmware (4 ticks per bit) and with
+# UART_OVERSAMPLE=8, and prints the reply success rates side by side
+# Run from the code directory: sim/oversample.sh [firmware options]
+set -e
+cd "$(dirname "$0")"
+gcc -g -O2 -Wall -I. "$@" -o ballast-sim-4x sim.c
+gcc -g -O2 -Wall -I. "$@" -DUART_OVERSAMPLE=8 -o ballast-sim-8x sim.c
+cd ..
+out=$(mktemp -d)
+trap 'rm -rf "$out"' EXIT
+sim/ballast-sim-4x > "$out/4x"
+sim/ballast-sim-8x > "$out/8x"
+printf "%-16s %8s %8s\n" scenario "ok 4x" "ok 8x"
+# Scenario rows follow the header, name and ok are fixed width columns
+awk 'FNR == NR { if(rows) ok[FNR] = substr($0, 25, 8); if(/^scenario/) rows = 1; next }
+	rows2 { printf "%-16s %8s %8s\n", substr($0, 1, 16), ok[FNR], substr($0, 25, 8) }
+	/^scenario/ { rows2 = 1 }' "$out/4x" "$out/8x"
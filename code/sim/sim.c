@@ -0,0 +1,1487 @@
+/**
+ * Host simulation and benchmark harness for the ballast emulator firmware
+ *
+ * Builds attiny-ballast.c for the host with the Attiny85 registers
+ * replaced by variables (see avr/io.h in this directory). Timers 0
+ * and 1, pin change interrupt and the pins are simulated with 1 us
+ * (8 clock) resolution, firmware code itself takes no simulated time.
+ * Firmware clock may run off by a given error, and OSCCAL moves it
+ * with a fixed step.
+ *
+ * The projector side is a waveform generator on RX (PB0) and a UART
+ * decoder on TX (PB1). Benchmark scenarios send queries from the
+ * query table with baud error, edge jitter, glitches, noise spikes, back-to-back
+ * queries and unknown queries, and report how many replies were
+ * decoded correctly and the reply latency in timer ticks, not counting
+ * the reply delay of the query (@ in the query table). Each scenario
+ * runs in its own process, so firmware boots fresh for every scenario.
+ *
+ * With -c the firmware decodes a logic analyzer capture instead, see
+ * Capture decoder below.
+ *
+ * Only the software UART is simulated, USI is not modelled.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// Firmware names that clash with the host C library
+#define main firmwareMain
+#define mode_t firmwareMode_t
+#include "../attiny-ballast.c"
+#undef main
+#undef mode_t
+
+#ifdef USI_UART
+#error "USI is not simulated, build without USI_UART"
+#endif
+#ifdef STACK_CHECK
+#error "SRAM layout is not simulated, build without STACK_CHECK"
+#endif
+
+
+// Registers
+volatile uint8_t PINB, PORTB, DDRB;
+volatile uint8_t TCCR1, TCNT1, OCR1A, OCR1B, OCR1C, GTCCR, TIMSK, TIFR;
+volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, OCR0B;
+volatile uint8_t USIDR, USIBR, USISR, USICR;
+volatile uint8_t GIMSK, PCMSK, GIFR, MCUCR, MCUSR, PRR, ACSR;
+volatile uint8_t OSCCAL, CLKPR, GPIOR0, GPIOR1, GPIOR2;
+volatile uint8_t EECR, EEDR, WDTCR;
+volatile uint16_t EEAR;
+
+
+/**
+ * Simulator core
+ */
+
+typedef struct {
+	uint64_t time;			// us
+	uint8_t level;
+} edge_t;
+
+typedef struct {
+	edge_t *edge;
+	size_t count;
+	size_t size;
+} wave_t;
+
+static double simTime = 0;		// Simulation time, real us
+static double simEnd = 0;		// Stop simulation at this time
+static uint32_t simSteps = 0;		// Firmware clock / 8
+
+// Firmware clock is off by this error at the factory OSCCAL value,
+// every OSCCAL step away from it changes the clock by SIM_OSCCAL_STEP
+#define SIM_OSCCAL		0x60
+#define SIM_OSCCAL_STEP		0.005
+static double simClockError = 0;
+static jmp_buf simExit;
+
+static uint8_t simInterrupts = 0;	// Global interrupt enable
+static uint8_t simTimerFlags = 0;	// Real TIFR
+static uint8_t simPinFlags = 0;		// Real GIFR
+static uint8_t simPins = 0;		// Pin levels from the projector side
+static uint8_t simLastPins = 0;		// For pin change detection
+
+static wave_t rxWave;			// Projector -> emulator
+static size_t rxPos = 0;
+static void (*rxRefill)(void) = 0;	// Adds more of rxWave when all is used
+static wave_t txWave;			// Emulator -> projector
+static int txRecord = 1;		// TX is recorded to txWave
+
+static void (*simTraceHook)(uint8_t type, uint8_t data) = 0;
+static void (*simWaitHook)(void) = 0;
+
+static void waveAdd(wave_t *wave, uint64_t time, uint8_t level)
+{
+	if(wave->count && wave->edge[wave->count - 1].level == level)
+		return;
+	if(wave->count == wave->size) {
+		wave->size = wave->size ? 2 * wave->size : 1024;
+		wave->edge = realloc(wave->edge, wave->size * sizeof(edge_t));
+		if(!wave->edge) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	wave->edge[wave->count].time = time;
+	wave->edge[wave->count].level = level;
+	wave->count++;
+}
+
+void simSei(void)
+{
+	simInterrupts = 1;
+}
+
+void simCli(void)
+{
+	simInterrupts = 0;
+}
+
+// Apply the write-one-to-clear writes to interrupt flag registers
+static void simClearFlags(void)
+{
+	simTimerFlags &= ~TIFR;
+	TIFR = 0;
+	simPinFlags &= ~GIFR;
+	GIFR = 0;
+}
+
+// Record the TX pin as driven by the firmware
+static void simCaptureTx(void)
+{
+	uint8_t level = 1;	// Optoisolator input idles high
+
+	if(!txRecord)
+		return;
+	if(DDRB & TXPIN)
+		level = (PORTB & TXPIN) ? 1 : 0;
+	waveAdd(&txWave, (uint64_t)(simTime + 0.5), level);
+}
+
+static void simCall(void (*vector)(void))
+{
+	if(!vector) {
+		fprintf(stderr, "Interrupt without handler at %.0f us\n", simTime);
+		exit(1);
+	}
+	simInterrupts = 0;
+	vector();
+	simInterrupts = 1;
+	simClearFlags();
+	simCaptureTx();
+}
+
+// Run pending interrupts, in vector priority order
+// Returns the number of handlers run
+static int simDispatch(void)
+{
+	int count = 0;
+
+	simClearFlags();
+	while(simInterrupts) {
+		if((simPinFlags & (1 << PCIF)) && (GIMSK & (1 << PCIE))) {
+			simPinFlags &= ~(1 << PCIF);
+			simCall(PCINT0_vect);
+		} else if((simTimerFlags & (1 << OCF1A)) && (TIMSK & (1 << OCIE1A))) {
+			simTimerFlags &= ~(1 << OCF1A);
+			simCall(TIMER1_COMPA_vect);
+		} else if((simTimerFlags & (1 << OCF1B)) && (TIMSK & (1 << OCIE1B))) {
+			simTimerFlags &= ~(1 << OCF1B);
+			simCall(TIMER1_COMPB_vect);
+		} else {
+			break;
+		}
+		count++;
+	}
+	return count;
+}
+
+// Advance the simulation by 8 firmware clocks, 1 us on exact clock
+// Returns the number of interrupt handlers run
+static int simStep(void)
+{
+	uint8_t changed;
+
+	simCaptureTx();
+	simSteps++;
+	simTime += 1.0 / ((1.0 + simClockError) * (1.0 + (OSCCAL - SIM_OSCCAL) * SIM_OSCCAL_STEP));
+	if(simTime >= simEnd)
+		longjmp(simExit, 1);
+
+	// Projector drives RX, other inputs stay as set by the scenario
+	if(rxPos == rxWave.count && rxRefill)
+		rxRefill();
+	while(rxPos < rxWave.count && rxWave.edge[rxPos].time <= simTime) {
+		if(rxWave.edge[rxPos].level)
+			simPins |= RXPIN;
+		else
+			simPins &= ~RXPIN;
+		rxPos++;
+	}
+	PINB = simPins;
+	changed = (simPins ^ simLastPins) & PCMSK;
+	simLastPins = simPins;
+	if(changed)
+		simPinFlags |= (1 << PCIF);
+
+	// Timer 0 in normal mode, free running
+	if(TCCR0B & 0x07) {
+		uint32_t prescale;
+
+		if((TCCR0B & 0x07) == (1 << CS02))
+			prescale = 256 / 8;
+		else if((TCCR0B & 0x07) == ((1 << CS01) | (1 << CS00)))
+			prescale = 64 / 8;
+		else
+			prescale = 0;
+		if(TCCR0A || !prescale) {
+			fprintf(stderr, "Timer 0 mode not simulated: TCCR0A = 0x%02X, TCCR0B = 0x%02X\n", TCCR0A, TCCR0B);
+			exit(1);
+		}
+		if(!(simSteps % prescale))
+			TCNT0++;
+	}
+
+	// Timer 1 in CTC mode, CLK / 8 prescaler = 1 us per count
+	if(TCCR1 & 0x0F) {
+		if((TCCR1 & 0x0F) != (1 << CS12)) {
+			fprintf(stderr, "Timer 1 prescaler not simulated: TCCR1 = 0x%02X\n", TCCR1);
+			exit(1);
+		}
+		if((TCCR1 & (1 << CTC1)) && TCNT1 == OCR1C)
+			TCNT1 = 0;
+		else
+			TCNT1++;
+		if(TCNT1 == OCR1A)
+			simTimerFlags |= (1 << OCF1A);
+		if(TCNT1 == OCR1B)
+			simTimerFlags |= (1 << OCF1B);
+	}
+
+	return simDispatch();
+}
+
+// Boot time, until interrupts are on and the UART receives
+// Firmware restarts the UART if the straps select another mode than Ushio
+static double simReadyTime = -1;
+
+void simReady(void)
+{
+	simReadyTime = simTime;
+}
+
+// EEPROM write in progress, see avr/eeprom.h
+#define SIM_EEPROM_WRITE_US	3400
+static double simEepromBusy = 0;	// End of write
+static int simEepromStalls = 0;		// Accesses while busy
+static int simEepromWrites = 0;
+
+static void simEepromCheck(void)
+{
+	if(simTime < simEepromBusy)
+		simEepromStalls++;
+}
+
+// EEPROM by address, for data that is not in EEMEM variables
+static uint8_t simEeprom[E2END + 1];
+
+// Host address of an EEPROM access
+static uint8_t *simEepromAddress(const uint8_t *addr)
+{
+	if((uintptr_t)addr <= E2END)
+		return &simEeprom[(uintptr_t)addr];
+	return (uint8_t *)addr;
+}
+
+uint8_t simEepromRead(const uint8_t *addr)
+{
+	simEepromCheck();
+	return *simEepromAddress(addr);
+}
+
+void simEepromUpdate(uint8_t *addr, uint8_t value)
+{
+	simEepromCheck();
+	addr = simEepromAddress(addr);
+	if(*addr == value)
+		return;
+	*addr = value;
+	simEepromBusy = simTime + SIM_EEPROM_WRITE_US;
+	simEepromWrites++;
+}
+
+int simEepromReady(void)
+{
+	return simTime >= simEepromBusy;
+}
+
+void simWait(void)
+{
+	simStep();
+	if(simWaitHook)
+		simWaitHook();
+}
+
+void simTrace(uint8_t type, uint8_t data)
+{
+	if(simTraceHook)
+		simTraceHook(type, data);
+}
+
+// Sleep until an interrupt wakes the core
+void simSleep(void)
+{
+	while(!simStep());
+}
+
+void simDelay(unsigned long us)
+{
+	while(us--)
+		simStep();
+}
+
+
+/**
+ * Projector side: query table, waveform generator and reply decoder
+ */
+
+#define MAX_MESSAGE	16
+
+typedef struct {
+	uint8_t query[MAX_MESSAGE];
+	uint8_t qLength;
+	uint8_t reply[MAX_MESSAGE];
+	uint8_t rLength;
+	double delay;			// Reply delay, us
+} message_t;
+
+static message_t table[64];
+static int tableLength = 0;
+
+// Read the query table, same format as gen-queries.py
+static void readTable(const char *filename)
+{
+	char line[256];
+	FILE *f = fopen(filename, "r");
+
+	if(!f) {
+		perror(filename);
+		exit(1);
+	}
+	while(fgets(line, sizeof(line), f) && tableLength < 64) {
+		message_t *m = &table[tableLength];
+		char *p = line, *end;
+		uint8_t *data = m->query, *length = &m->qLength;
+		unsigned long value;
+		int i;
+
+		if(strchr(line, '#'))
+			*strchr(line, '#') = 0;
+		if(!strchr(line, ':'))
+			continue;
+		memset(m, 0, sizeof(*m));
+		while(*p) {
+			if(*p == '@') {
+				// Reply delay, ticks are 1/4 bits at the Ushio bit rate
+				m->delay = strtod(p + 1, &end);
+				while(*end == ' ' || *end == '\t')
+					end++;
+				if(!strncmp(end, "ms", 2))
+					m->delay *= 1000;
+				else if(!strncmp(end, "ticks", 5))
+					m->delay *= 1e6 / (4 * USHIO_BAUD);
+				break;
+			}
+			if(*p == ':') {
+				data = m->reply;
+				length = &m->rLength;
+				p++;
+				continue;
+			}
+			value = strtoul(p, &end, 16);
+			if(end == p) {
+				p++;
+				continue;
+			}
+			if(*length < MAX_MESSAGE)
+				data[(*length)++] = value;
+			p = end;
+		}
+
+		// First one wins, skip duplicates
+		for(i = 0; i < tableLength; i++) {
+			if(table[i].qLength == m->qLength && !memcmp(table[i].query, m->query, m->qLength))
+				break;
+		}
+		if(i == tableLength && m->qLength)
+			tableLength++;
+	}
+	fclose(f);
+}
+
+static uint32_t randomState = 1;
+
+// xorshift32, same sequence on every host
+static uint32_t randomNext(void)
+{
+	randomState ^= randomState << 13;
+	randomState ^= randomState >> 17;
+	randomState ^= randomState << 5;
+	return randomState;
+}
+
+// Uniform random in [-range, range]
+static double randomRange(double range)
+{
+	return range * ((randomNext() % 20001) / 10000.0 - 1.0);
+}
+
+typedef struct {
+	const char *name;
+	double baudError;		// Relative error of projector baud rate
+	double clockError;		// Relative error of firmware clock
+	double jitter;			// Max random shift of each edge, us
+	double gap;			// Idle time between queries, us
+	double glitch;			// Low pulse before each query, us, 0 = none
+	double spike;			// Inverted pulse near the center of one bit per byte, us
+	int unknown;			// Unknown query of n bytes right before each query,
+					// negative: without terminator and followed by a short gap
+	int burst;			// Queries sent back-to-back before each gap, 0 = 1
+	int baud;			// Projector baud rate, 0 = Ushio, no replies expected for others
+	double start;			// First query after reset, us
+	int clean;			// Clean line, any receive error fails the run
+} scenario_t;
+
+typedef struct {
+	int scenario;
+	int burst;			// Queries of the same burst share this
+	const message_t *message;
+	uint64_t end;			// Stop bit center of the last byte
+} sent_t;
+
+static sent_t *sent = 0;
+static int sentCount = 0;
+static double baud = USHIO_BAUD;
+
+// Even parity bit
+static int parity(uint8_t data)
+{
+	int p = 0;
+
+	while(data) {
+		p ^= data & 1;
+		data >>= 1;
+	}
+	return p;
+}
+
+// Generate frames for bytes starting at time, returns end time
+static double sendBytes(double time, const uint8_t *data, int length, const scenario_t *s)
+{
+	double bit = 1e6 / (baud * (1.0 + s->baudError));
+	int i, b, level;
+
+	for(i = 0; i < length; i++) {
+		uint16_t frame = (data[i] << 1) | (parity(data[i]) << 9) | (1 << 10);
+
+		int spikeBit = (s->spike > 0) ? (int)(randomNext() % 11) : -1;
+
+		for(b = 0; b < 11; b++) {
+			level = (frame >> b) & 1;
+			waveAdd(&rxWave, (uint64_t)(time + b * bit + randomRange(s->jitter) + 0.5), level);
+			if(b == spikeBit) {
+				// Noise through the optoisolator, close to the sample point
+				double center = time + (b + 0.5) * bit + randomRange(bit / 8);
+
+				waveAdd(&rxWave, (uint64_t)(center - s->spike / 2 + 0.5), !level);
+				waveAdd(&rxWave, (uint64_t)(center + s->spike / 2 + 0.5), level);
+			}
+		}
+		time += 11 * bit;
+	}
+	return time;
+}
+
+// Add a query to the stimulus, returns end of stop bit
+static double sendQuery(double time, int scenario, int burst, const scenario_t *s)
+{
+	const message_t *m = &table[randomNext() % tableLength];
+	double bit = 1e6 / (baud * (1.0 + s->baudError));
+	uint8_t unknown[3] = {0x7F, 0x20, 0x0D};
+
+	if(s->glitch > 0) {
+		waveAdd(&rxWave, (uint64_t)time, 0);
+		waveAdd(&rxWave, (uint64_t)(time + s->glitch), 1);
+		time += s->glitch + 1000;
+	}
+	unknown[0] = 0x60 + randomNext() % 0x20;	// Not the first byte of any known query
+	if(s->unknown > 0) {
+		time = sendBytes(time, unknown + 3 - s->unknown, s->unknown, s);
+	} else if(s->unknown < 0) {
+		time = sendBytes(time, unknown, -s->unknown, s);
+		time += 1.5 * 11 * bit;		// Longer than normal, shorter than the 50 ms timeout
+	}
+	time = sendBytes(time, m->query, m->qLength, s);
+
+	sent = realloc(sent, (sentCount + 1) * sizeof(sent_t));
+	sent[sentCount].scenario = scenario;
+	sent[sentCount].burst = burst;
+	sent[sentCount].message = m;
+	sent[sentCount].end = (uint64_t)(time - bit / 2);	// UART takes the byte at stop bit center
+	sentCount++;
+
+	// Leave room for a reply longer than its query so that the
+	// reply backlog does not grow without bound with zero gap,
+	// in bursts the backlog is bounded by the burst length
+	if(m->rLength > m->qLength && !s->burst)
+		time += (m->rLength - m->qLength) * 11 * bit;
+	return time;
+}
+
+typedef struct {
+	uint64_t start;			// Falling edge of start bit
+	uint8_t data;
+	uint8_t error;			// Parity or framing error
+} received_t;
+
+static received_t *received = 0;
+static int receivedCount = 0;
+
+// Level of wave at time
+static uint8_t waveLevel(const wave_t *wave, size_t *pos, uint64_t time)
+{
+	while(*pos + 1 < wave->count && wave->edge[*pos + 1].time <= time)
+		(*pos)++;
+	return wave->edge[*pos].level;
+}
+
+// Decode TX like a projector UART: sample each bit at its center
+static void decodeTx(void)
+{
+	double bit = 1e6 / baud;
+	size_t i, pos = 0;
+	int b;
+
+	for(i = 1; i < txWave.count; i++) {
+		uint64_t start;
+		uint16_t frame = 0;
+
+		if(txWave.edge[i].level || !txWave.edge[i - 1].level)
+			continue;
+		start = txWave.edge[i].time;
+		pos = i;
+		for(b = 0; b < 11; b++)
+			frame |= waveLevel(&txWave, &pos, start + (uint64_t)((b + 0.5) * bit)) << b;
+
+		received = realloc(received, (receivedCount + 1) * sizeof(received_t));
+		received[receivedCount].start = start;
+		received[receivedCount].data = (frame >> 1) & 0xFF;
+		received[receivedCount].error = (frame & 0x001) || !(frame & 0x400) ||
+			(((frame >> 9) & 1) != parity((frame >> 1) & 0xFF));
+		receivedCount++;
+
+		// Continue after the stop bit center
+		while(i + 1 < txWave.count && txWave.edge[i + 1].time < start + (uint64_t)(10.5 * bit))
+			i++;
+	}
+}
+
+typedef struct {
+	int sent;
+	int ok;
+	double latencySum;		// Ticks
+	double latencyMin;
+	double latencyMax;
+	int first;			// First query replied
+} result_t;
+
+// Pair each query with the reply bytes that follow it, in order
+static void score(result_t *result, int scenarios)
+{
+	double tick = TICK_COUNTS(USHIO_BAUD, USHIO_TICKS);
+	int i, j, next, r = 0;
+
+	for(i = 0; i < scenarios; i++) {
+		result[i].latencyMin = 1e9;
+		result[i].latencyMax = 0;
+	}
+
+	for(i = 0; i < sentCount; i++) {
+		const message_t *m = sent[i].message;
+		result_t *res = &result[sent[i].scenario];
+		double latency;
+
+		res->sent++;
+
+		// Skip bytes sent before the query was complete
+		while(r < receivedCount && received[r].start < sent[i].end)
+			r++;
+		if(r + m->rLength > receivedCount)
+			continue;
+		// Replies to a burst may lag behind its queries, but not
+		// past the first query of the next burst
+		for(next = i + 1; next < sentCount && sent[next].burst == sent[i].burst; next++);
+		if(next < sentCount && received[r].start >= sent[next].end)
+			continue;	// No reply before next burst was complete
+
+		for(j = 0; j < m->rLength; j++) {
+			if(received[r + j].error || received[r + j].data != m->reply[j])
+				break;
+		}
+		if(j < m->rLength)
+			continue;
+
+		latency = (received[r].start - sent[i].end - m->delay) / tick;
+		res->ok++;
+		if(res->sent == 1)
+			res->first = 1;
+		res->latencySum += latency;
+		if(latency < res->latencyMin) res->latencyMin = latency;
+		if(latency > res->latencyMax) res->latencyMax = latency;
+		r += m->rLength;
+	}
+}
+
+static const scenario_t scenarios[] = {
+	// name			baud error	clock	jitter	gap	glitch	spike	unknown	burst	baud	start	clean
+	{"first at t=0",	0.0,		0.0,	0,	30000,	0,	0,	0,	0,	0,	0,	0},
+	{"nominal",		0.0,		0.0,	0,	30000,	0,	0,	0,	0,	0,	100000,	1},
+	{"baud +2%",		0.02,		0.0,	0,	30000,	0,	0,	0,	0,	0,	100000,	0},
+	{"baud -2%",		-0.02,		0.0,	0,	30000,	0,	0,	0,	0,	0,	100000,	0},
+	{"baud +4%",		0.04,		0.0,	0,	30000,	0,	0,	0,	0,	0,	100000,	0},
+	{"baud -4%",		-0.04,		0.0,	0,	30000,	0,	0,	0,	0,	0,	100000,	0},
+	{"clock +5%",		0.0,		0.05,	0,	30000,	0,	0,	0,	0,	0,	100000,	0},
+	{"clock -5%",		0.0,		-0.05,	0,	30000,	0,	0,	0,	0,	0,	100000,	0},
+	{"clock +10%",		0.0,		0.10,	0,	30000,	0,	0,	0,	0,	0,	100000,	0},
+	{"clock -10%",		0.0,		-0.10,	0,	30000,	0,	0,	0,	0,	0,	100000,	0},
+	{"jitter 30 us",	0.0,		0.0,	30,	30000,	0,	0,	0,	0,	0,	100000,	0},
+	{"jitter 60 us",	0.0,		0.0,	60,	30000,	0,	0,	0,	0,	0,	100000,	0},
+	{"glitch 5 us",		0.0,		0.0,	0,	30000,	5,	0,	0,	0,	0,	100000,	0},
+	{"glitch 50 us",	0.0,		0.0,	0,	30000,	50,	0,	0,	0,	0,	100000,	0},
+	{"spikes 10 us",	0.0,		0.0,	0,	30000,	0,	10,	0,	0,	0,	100000,	0},
+	{"spikes 20 us",	0.0,		0.0,	0,	30000,	0,	20,	0,	0,	0,	100000,	0},
+	{"back-to-back",	0.0,		0.0,	0,	0,	0,	0,	0,	0,	0,	100000,	1},
+	{"burst of 4",		0.0,		0.0,	0,	100000,	0,	0,	0,	4,	0,	100000,	0},
+	{"burst of 8",		0.0,		0.0,	0,	100000,	0,	0,	0,	8,	0,	100000,	1},
+	{"unknown first",	0.0,		0.0,	0,	30000,	0,	0,	3,	0,	0,	100000,	0},
+	{"unknown short",	0.0,		0.0,	0,	30000,	0,	0,	1,	0,	0,	100000,	0},
+	{"unknown cut",		0.0,		0.0,	0,	30000,	0,	0,	-2,	0,	0,	100000,	0},
+	{"osram 9600",		0.0,		0.0,	0,	30000,	0,	0,	0,	0,	OSRAM_BAUD,	100000,	1},
+	{"osram burst 8",	0.0,		0.0,	0,	100000,	0,	0,	0,	8,	OSRAM_BAUD,	100000,	1},
+	};
+#define SCENARIOS	(sizeof(scenarios) / sizeof(scenarios[0]))
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-n queries] [-s seed] [-t ushio-queries.txt] [-e eeprom.eep]\n"
+		"       %s -c capture.vcd|capture.csv [-o] [-R rx] [-T tx] [-F samplerate] [-t table] [-e eeprom.eep]\n", name, name);
+	exit(1);
+}
+
+#ifdef COUNTERS
+static uint64_t diagTime = 0;		// Diagnostic query sent
+
+// Decode the diagnostic reply and print the error and drop counts,
+// returns the receive errors or -1 without a reply
+static int printDiag(void)
+{
+	const received_t *r = received;
+	size_t n = receivedCount, i;
+	uint16_t value[COUNTERS_SIZE];
+
+	while(n && r->start < diagTime) {
+		r++;
+		n--;
+	}
+	if(n < DIAG_REPLY_LENGTH || r[0].data != 0x7E || r[1].data != COUNTERS_SIZE) {
+		printf(" %17s", "no diag reply");
+		return -1;
+	}
+	for(i = 0; i < COUNTERS_SIZE; i++)
+		value[i] = r[2 + 2 * i].data | (r[3 + 2 * i].data << 8);
+	printf(" %5d %5d %5d", value[COUNT_PARITY] + value[COUNT_FRAMING], value[COUNT_UNKNOWN], value[COUNT_TIMEOUT]);
+	return value[COUNT_PARITY] + value[COUNT_FRAMING];
+}
+#endif
+
+#ifdef LEARN
+// Print the learned queries and their hits, in EEPROM and not yet flushed
+static void printLearn(void)
+{
+	int i, entries = 0, hits = 0;
+
+	for(i = 0; i < LEARN_ENTRIES; i++) {
+		const learnEntry_t *e = &eeLearn.entry[i];
+
+		if(e->length == LEARN_FREE)
+			continue;
+		entries++;
+		hits += e->count[0] + (e->count[1] << 8) + learnHits[i];
+	}
+	printf(" %5d %5d %6d", entries, hits, simEepromWrites);
+}
+#endif
+
+// Simulated EEPROM, see avr/eeprom.h, weak when firmware has no EEMEM
+extern uint8_t __start_sim_eeprom[] __attribute__((weak));
+extern uint8_t __stop_sim_eeprom[] __attribute__((weak));
+
+static const char *eepromFile = 0;
+
+// Load an Intel hex EEPROM image, EEPROM is erased elsewhere
+static void readEeprom(const char *filename)
+{
+	FILE *f = fopen(filename, "r");
+	char line[600];
+	unsigned int length, address, type, value, i;
+
+	if(!f) {
+		perror(filename);
+		exit(1);
+	}
+	while(fgets(line, sizeof(line), f)) {
+		if(sscanf(line, ":%2x%4x%2x", &length, &address, &type) != 3 || type != 0)
+			continue;
+		for(i = 0; i < length && address + i <= E2END; i++) {
+			if(sscanf(line + 9 + 2 * i, "%2x", &value) == 1)
+				simEeprom[address + i] = value;
+		}
+	}
+	fclose(f);
+}
+
+// Run one scenario on freshly booted firmware and print its results
+static void runScenario(int index, int queries)
+{
+	const scenario_t *s = &scenarios[index];
+	result_t result[SCENARIOS];
+	double time = s->start;
+	int burst = 0;
+	int n, errors = 0;
+
+	if(s->baud)
+		baud = s->baud;
+	waveAdd(&rxWave, 0, 1);
+	for(n = 0; n < queries; n++) {
+		time = sendQuery(time, index, burst, s);
+		if(s->burst && (n + 1) % s->burst)
+			continue;	// Rest of the burst follows right away
+		time += s->gap;
+		burst++;
+	}
+#ifdef COUNTERS
+	// Read the counters with the diagnostic query, without noise
+	scenario_t quiet = *s;
+
+	quiet.spike = 0;
+	time += 100000;
+	diagTime = time;
+	time = sendBytes(time, diagQuery, DIAG_QUERY_LENGTH, &quiet) + DIAG_REPLY_LENGTH * 11e6 / baud;
+#endif
+
+	// Ushio mode: both ID pins and Sync pulled up
+	simPins = simLastPins = PINB = RXPIN | SYNCPIN | ID0 | ID1;
+#ifndef AUTO_SERIAL
+	// Osram mode is strapped: ID0 low
+	if(s->baud == OSRAM_BAUD)
+		simPins = simLastPins = PINB = RXPIN | SYNCPIN | ID1;
+#endif
+	OSCCAL = SIM_OSCCAL;
+	memset(simEeprom, 0xFF, sizeof(simEeprom));
+	if(__start_sim_eeprom)
+		memset(__start_sim_eeprom, 0xFF, __stop_sim_eeprom - __start_sim_eeprom);
+	if(eepromFile)
+		readEeprom(eepromFile);
+	simClockError = s->clockError;
+	simEnd = time + 100000;		// Time for the last reply
+	if(!setjmp(simExit))
+		firmwareMain();
+
+	decodeTx();
+	memset(result, 0, sizeof(result));
+	score(result, SCENARIOS);
+
+	printf("%-16s %6d", s->name, result[index].sent);
+	if(s->baud)
+		printf(" %8s", "-");
+	else
+		printf(" %7.1f%%", 100.0 * result[index].ok / result[index].sent);
+	if(result[index].ok && !s->baud)
+		printf(" %8.1f %8.1f %8.1f", result[index].latencyMin,
+			result[index].latencySum / result[index].ok, result[index].latencyMax);
+	else
+		printf(" %8s %8s %8s", "-", "-", "-");
+	printf(" %+7d %6s %7.0f %3s", OSCCAL - SIM_OSCCAL, operationMode == OSRAM ? "Osram" : "Ushio", simReadyTime,
+		s->baud ? "-" : result[index].first ? "yes" : "no");
+#ifdef COUNTERS
+	errors = printDiag();
+#endif
+#ifdef LEARN
+	printLearn();
+#endif
+	printf("\n");
+	if(simEepromStalls)
+		fprintf(stderr, "%s: %d EEPROM accesses while busy\n", s->name, simEepromStalls);
+	if(s->clean && errors) {
+		fflush(stdout);
+		fprintf(stderr, "%s: receive errors on a clean line\n", s->name);
+		exit(1);
+	}
+}
+
+/**
+ * Capture decoder
+ *
+ * Runs the firmware on RX (PB0) of a logic analyzer capture, VCD or CSV
+ * as exported by sigrok, and prints a transcript of what it decoded:
+ * every query with its bytes and whether it matched, was unknown or
+ * timed out, straight from the trace records of the serial loop. TX
+ * (PB1) of the capture, what the emulator replied, is decoded alongside
+ * at the bit rate of the detected mode and compared with the reply of
+ * the table. The capture is memory mapped and parsed as the simulation
+ * advances, so it may be larger than memory. Times are from the start
+ * of the capture.
+ */
+
+#define CAPTURE_BOOT		100000	// us of idle RX for the firmware to boot
+#define CAPTURE_CHUNK		1024	// RX edges parsed at a time
+#define CAPTURE_NO_REPLY	500000	// us, match without a reply by then has none
+#define CAPTURE_PENDING		64	// Matches waiting for their reply
+
+typedef struct {
+	const char *p, *end;		// Mapped file, parse position
+	size_t size;
+	int csv;
+	double scale;			// us per VCD time unit or per CSV sample
+	char rxId[16], txId[16];	// VCD identifier codes
+	int rxColumn, txColumn;		// CSV columns
+	int timeColumn;			// CSV time column (s), -1 = one row per sample
+	double time;			// Parsed up to, us
+	uint64_t sampleCount;		// CSV rows without a time column
+	int done;
+} capture_t;
+
+static capture_t capture;
+static const char *captureRx = 0, *captureTx = 0;	// Channel names
+static double captureRate = 0;		// CSV samples per second
+static int captureOsram = 0;		// Osram straps
+
+static wave_t capTx;			// Captured TX, sim time
+static size_t capTxPos = 0;		// Next edge to decode
+
+// Query being received by the firmware
+static uint8_t capQuery[MAX_MESSAGE];
+static uint8_t capQueryErrors[MAX_MESSAGE];
+static int capQueryLength = 0;
+static double capQueryTime = 0;
+
+// Reply being received on the captured TX
+static uint8_t capReply[MAX_MESSAGE];
+static int capReplyLength = 0, capReplyErrors = 0;
+static double capReplyTime = 0, capReplyLast = 0;
+
+// Matched queries waiting for their reply, in order
+static struct {
+	double time;
+	int query;			// -1 diagnostic query
+} capPending[CAPTURE_PENDING];
+static int capPendingRead = 0, capPendingWrite = 0;
+
+static struct {
+	int matched, unknown, timeout, errors, diag;
+	int ok, differs, missing, unexpected;
+	double latencySum, latencyMin, latencyMax;
+} capStats = {.latencyMin = 1e18};
+
+static double captureBit(void)
+{
+	return 1e6 / (operationMode == OSRAM ? OSRAM_BAUD : USHIO_BAUD);
+}
+
+static void capturePrint(double time, char line, const uint8_t *data, const uint8_t *errors, int length, const char *note)
+{
+	char bytes[4 * MAX_MESSAGE + 1] = "";
+	int i;
+
+	for(i = 0; i < length; i++)
+		sprintf(bytes + strlen(bytes), "%02X%s ", data[i], (errors && errors[i]) ? "!" : "");
+	printf("%12.3f %c  %-24s %s\n", (time - CAPTURE_BOOT) / 1000, line, bytes, note);
+}
+
+// Next whitespace separated token, 0 at end of file
+static const char *captureToken(size_t *length)
+{
+	const char *start;
+
+	while(capture.p < capture.end && isspace((unsigned char)*capture.p))
+		capture.p++;
+	if(capture.p == capture.end)
+		return 0;
+	start = capture.p;
+	while(capture.p < capture.end && !isspace((unsigned char)*capture.p))
+		capture.p++;
+	*length = capture.p - start;
+	return start;
+}
+
+// Next line without the newline, 0 at end of file
+static const char *captureLine(size_t *length)
+{
+	const char *start = capture.p;
+
+	if(capture.p == capture.end)
+		return 0;
+	while(capture.p < capture.end && *capture.p != '\n')
+		capture.p++;
+	*length = capture.p - start;
+	if(capture.p < capture.end)
+		capture.p++;
+	if(*length && start[*length - 1] == '\r')
+		(*length)--;
+	return start;
+}
+
+static int tokenIs(const char *token, size_t length, const char *text)
+{
+	return length == strlen(text) && !memcmp(token, text, length);
+}
+
+// Time unit in us, e.g. "1 us", "10ns"
+static double captureUnit(const char *text)
+{
+	char *end;
+	double value = strtod(text, &end);
+
+	while(isspace((unsigned char)*end))
+		end++;
+	if(end == text)
+		value = 1;
+	if(!strncmp(end, "ps", 2)) return value * 1e-6;
+	if(!strncmp(end, "ns", 2)) return value * 1e-3;
+	if(!strncmp(end, "us", 2)) return value;
+	if(!strncmp(end, "ms", 2)) return value * 1e3;
+	return value * 1e6;		// s
+}
+
+// Channel name matches the requested one, or the default ones
+static int captureName(const char *name, size_t length, const char *wanted, const char *default1, const char *default2)
+{
+	if(wanted)
+		return tokenIs(name, length, wanted);
+	return tokenIs(name, length, default1) || tokenIs(name, length, default2);
+}
+
+static void captureHeaderVcd(void)
+{
+	const char *token, *name, *id;
+	size_t length, nameLength, idLength;
+	char text[64];
+
+	capture.scale = 1e-3;		// VCD default is 1 ns
+	while((token = captureToken(&length))) {
+		if(tokenIs(token, length, "$timescale")) {
+			text[0] = 0;
+			while((token = captureToken(&length)) && !tokenIs(token, length, "$end")) {
+				if(strlen(text) + length < sizeof(text) - 1)
+					strncat(text, token, length);
+			}
+			capture.scale = captureUnit(text);
+		} else if(tokenIs(token, length, "$var")) {
+			captureToken(&length);		// Type
+			captureToken(&length);		// Width
+			id = captureToken(&idLength);
+			name = captureToken(&nameLength);
+			if(!id || !name || idLength >= sizeof(capture.rxId))
+				break;
+			if(captureName(name, nameLength, captureRx, "PB0", "D0") && !capture.rxId[0])
+				memcpy(capture.rxId, id, idLength);
+			else if(captureName(name, nameLength, captureTx, "PB1", "D1") && !capture.txId[0])
+				memcpy(capture.txId, id, idLength);
+			while((token = captureToken(&length)) && !tokenIs(token, length, "$end"));
+		} else if(tokenIs(token, length, "$enddefinitions")) {
+			captureToken(&length);
+			return;
+		}
+	}
+	fprintf(stderr, "VCD has no $enddefinitions\n");
+	exit(1);
+}
+
+static void captureHeaderCsv(void)
+{
+	const char *line, *p;
+	size_t length;
+	int column;
+
+	capture.timeColumn = -1;
+	capture.rxColumn = capture.txColumn = -1;
+	while((line = captureLine(&length))) {
+		if(!length)
+			continue;
+		if(*line == ';' || *line == '#') {
+			// sigrok writes the sample rate as a comment
+			p = memchr(line, ':', length);
+			if(p && length > 12 && !strncmp(line + 2, "Samplerate", 10) && !captureRate) {
+				char text[32];
+				double rate;
+				char *end;
+
+				snprintf(text, sizeof(text), "%.*s", (int)(line + length - p - 1), p + 1);
+				rate = strtod(text, &end);
+				while(isspace((unsigned char)*end))
+					end++;
+				if(*end == 'k') rate *= 1e3;
+				if(*end == 'M') rate *= 1e6;
+				if(*end == 'G') rate *= 1e9;
+				captureRate = rate;
+			}
+			continue;
+		}
+		if(!isalpha((unsigned char)*line) && *line != '"') {
+			capture.p = line;	// No header, columns are RX and TX
+			capture.rxColumn = 0;
+			capture.txColumn = 1;
+			break;
+		}
+		for(column = 0, p = line; p < line + length; column++) {
+			const char *name = p, *end = memchr(p, ',', line + length - p);
+			size_t nameLength;
+
+			if(!end)
+				end = line + length;
+			p = end + 1;
+			while(name < end && (*name == '"' || *name == ' '))
+				name++;
+			nameLength = end - name;
+			while(nameLength && (name[nameLength - 1] == '"' || name[nameLength - 1] == ' '))
+				nameLength--;
+			if(nameLength >= 4 && !strncasecmp(name, "time", 4))
+				capture.timeColumn = column;
+			else if(captureName(name, nameLength, captureRx, "PB0", "D0") && capture.rxColumn < 0)
+				capture.rxColumn = column;
+			else if(captureName(name, nameLength, captureTx, "PB1", "D1") && capture.txColumn < 0)
+				capture.txColumn = column;
+		}
+		break;
+	}
+	if(capture.timeColumn < 0 && captureRate <= 0) {
+		fprintf(stderr, "CSV has neither a time column nor a sample rate, give it with -F\n");
+		exit(1);
+	}
+	capture.scale = (capture.timeColumn < 0) ? 1e6 / captureRate : 1e6;
+}
+
+static void captureEdge(int tx, int level)
+{
+	waveAdd(tx ? &capTx : &rxWave, (uint64_t)(CAPTURE_BOOT + capture.time + 0.5), level);
+}
+
+// Parse until at least one chunk of RX edges is added or the file ends
+static void captureParse(void)
+{
+	size_t start = rxWave.count, length;
+	const char *token, *line;
+
+	while(rxWave.count - start < CAPTURE_CHUNK && !capture.done) {
+		if(!capture.csv) {
+			if(!(token = captureToken(&length))) {
+				capture.done = 1;
+				break;
+			}
+			if(*token == '#') {
+				capture.time = strtod(token + 1, 0) * capture.scale;
+			} else if(*token == '$') {
+				// $dumpvars and the like hold values, $comment does not
+				if(tokenIs(token, length, "$comment"))
+					while((token = captureToken(&length)) && !tokenIs(token, length, "$end"));
+			} else if(*token == 'b' || *token == 'B' || *token == 'r' || *token == 'R') {
+				captureToken(&length);		// Vector value, identifier
+			} else if(length > 1) {
+				if(length - 1 == strlen(capture.rxId) && !memcmp(token + 1, capture.rxId, length - 1))
+					captureEdge(0, *token == '1');
+				else if(length - 1 == strlen(capture.txId) && !memcmp(token + 1, capture.txId, length - 1))
+					captureEdge(1, *token == '1');
+			}
+		} else {
+			char *p, *end;
+			int column;
+
+			if(!(line = captureLine(&length))) {
+				capture.done = 1;
+				break;
+			}
+			if(!length || *line == ';' || *line == '#')
+				continue;
+			p = (char *)line;
+			if(capture.timeColumn < 0)
+				capture.time = capture.sampleCount++ * capture.scale;
+			for(column = 0; p < line + length; column++) {
+				double value = strtod(p, &end);
+
+				if(column == capture.timeColumn)
+					capture.time = value * capture.scale;
+				else if(column == capture.rxColumn)
+					captureEdge(0, value != 0);
+				else if(column == capture.txColumn)
+					captureEdge(1, value != 0);
+				p = memchr(end, ',', line + length - end);
+				if(!p)
+					break;
+				p++;
+			}
+		}
+	}
+	if(capture.done)
+		simEnd = CAPTURE_BOOT + capture.time + CAPTURE_NO_REPLY;
+}
+
+// Called when all RX edges are used
+static void captureRefill(void)
+{
+	// Keep the last edge so that levels still alternate
+	rxWave.edge[0] = rxWave.edge[rxWave.count - 1];
+	rxWave.count = 1;
+	rxPos = 1;
+	captureParse();
+}
+
+// Oldest waiting match got no reply
+static void captureNoReply(void)
+{
+	char note[32];
+	int query = capPending[capPendingRead % CAPTURE_PENDING].query;
+
+	if(query < 0)
+		snprintf(note, sizeof(note), "no diagnostic reply");
+	else
+		snprintf(note, sizeof(note), "no reply to query %d", query);
+	capturePrint(capPending[capPendingRead % CAPTURE_PENDING].time, '-', 0, 0, 0, note);
+	capStats.missing++;
+	capPendingRead++;
+}
+
+// Expected reply of a waiting match
+static int captureExpected(int pending)
+{
+	int query = capPending[pending % CAPTURE_PENDING].query;
+
+	if(query < 0)
+		return capReplyLength >= 2 && capReply[0] == 0x7E;	// Diagnostic
+	return !capReplyErrors && table[query].rLength == capReplyLength &&
+		!memcmp(table[query].reply, capReply, capReplyLength);
+}
+
+// Pair the completed reply with the oldest waiting match that expects
+// it, matches before that got no reply. Without one it is a wrong reply
+// to the oldest match.
+static void captureReplyDone(void)
+{
+	char note[128];
+	double latency;
+	int pending, query, i;
+
+	if(!capReplyLength)
+		return;
+	for(pending = capPendingRead; pending != capPendingWrite; pending++) {
+		if(capPending[pending % CAPTURE_PENDING].time > capReplyTime || captureExpected(pending))
+			break;
+	}
+	if(pending == capPendingWrite || capPending[pending % CAPTURE_PENDING].time > capReplyTime)
+		pending = capPendingRead;
+	while(capPendingRead != pending)
+		captureNoReply();
+
+	if(pending == capPendingWrite || capPending[pending % CAPTURE_PENDING].time > capReplyTime) {
+		capturePrint(capReplyTime, 'R', capReply, 0, capReplyLength, "unexpected");
+		capStats.unexpected++;
+	} else {
+		query = capPending[pending % CAPTURE_PENDING].query;
+		latency = capReplyTime - capPending[pending % CAPTURE_PENDING].time;
+		snprintf(note, sizeof(note), "%.3f ms", latency / 1000);
+		if(captureExpected(pending)) {
+			if(query < 0)
+				strcat(note, ", diagnostic");
+			capStats.ok++;
+		} else {
+			strcat(note, ", expected");
+			for(i = 0; i < table[query].rLength; i++)
+				sprintf(note + strlen(note), " %02X", table[query].reply[i]);
+			capStats.differs++;
+		}
+		capturePrint(capReplyTime, 'R', capReply, 0, capReplyLength, note);
+		capStats.latencySum += latency;
+		if(latency < capStats.latencyMin) capStats.latencyMin = latency;
+		if(latency > capStats.latencyMax) capStats.latencyMax = latency;
+		capPendingRead++;
+	}
+	capReplyLength = 0;
+	capReplyErrors = 0;
+}
+
+// Matches that got no reply in time
+static void captureMissing(double now)
+{
+	while(capPendingRead != capPendingWrite &&
+	      capPending[capPendingRead % CAPTURE_PENDING].time + CAPTURE_NO_REPLY < now)
+		captureNoReply();
+}
+
+// Decode the captured TX frames that are complete at time now
+static void captureReplies(double now)
+{
+	double bit = captureBit();
+	size_t pos;
+	int b;
+
+	while(capTxPos < capTx.count) {
+		uint64_t start = capTx.edge[capTxPos].time;
+		uint16_t frame = 0;
+		uint8_t data;
+
+		if(capTx.edge[capTxPos].level) {
+			capTxPos++;
+			continue;
+		}
+		if(start + 10.5 * bit > now)
+			break;
+
+		pos = capTxPos;
+		for(b = 0; b < 11; b++)
+			frame |= waveLevel(&capTx, &pos, start + (uint64_t)((b + 0.5) * bit)) << b;
+		while(capTxPos < capTx.count && capTx.edge[capTxPos].time < start + 10.5 * bit)
+			capTxPos++;
+
+		// Frames closer than 2 bits of idle are one reply
+		if(capReplyLength && (start > capReplyLast + 13 * bit || capReplyLength == MAX_MESSAGE))
+			captureReplyDone();
+		if(!capReplyLength)
+			capReplyTime = start;
+		capReplyLast = start;
+		data = (frame >> 1) & 0xFF;
+		capReply[capReplyLength++] = data;
+		if((frame & 0x001) || !(frame & 0x400) || (((frame >> 9) & 1) != parity(data)))
+			capReplyErrors++;
+	}
+	if(capReplyLength && now > capReplyLast + 24 * bit)
+		captureReplyDone();
+	captureMissing(now);
+
+	// Drop the decoded edges now and then, the last one keeps the level
+	if(capTxPos > 4096 && capTxPos > capTx.count / 2) {
+		memmove(capTx.edge, &capTx.edge[capTxPos - 1], (capTx.count - capTxPos + 1) * sizeof(edge_t));
+		capTx.count -= capTxPos - 1;
+		capTxPos = 1;
+	}
+}
+
+static void captureWait(void)
+{
+	static double next = 0;
+
+	if(simTime >= next) {
+		captureReplies(simTime);
+		next = simTime + 10;
+	}
+}
+
+// Query that expects a reply
+static void capturePending(int query)
+{
+	if(capPendingWrite - capPendingRead == CAPTURE_PENDING)
+		return;
+	capPending[capPendingWrite % CAPTURE_PENDING].time = simTime;
+	capPending[capPendingWrite % CAPTURE_PENDING].query = query;
+	capPendingWrite++;
+}
+
+static void captureQueryDone(const char *note)
+{
+	capturePrint(capQueryTime, 'Q', capQuery, capQueryErrors, capQueryLength, note);
+	capQueryLength = 0;
+}
+
+// Trace records of the serial loop
+static void captureTrace(uint8_t type, uint8_t data)
+{
+	char note[32];
+
+	captureReplies(simTime);
+	switch(type & 0xF0) {
+	case TRACE_RX:
+		if(capQueryLength == MAX_MESSAGE)
+			captureQueryDone("too long to show");
+		if(!capQueryLength)
+			capQueryTime = simTime;
+		capQueryErrors[capQueryLength] = type & 0x0F;
+		capQuery[capQueryLength++] = data;
+		if(type & 0x0F)
+			capStats.errors++;
+#ifdef COUNTERS
+		// Diagnostic query has no trace record
+		if(capQueryLength == DIAG_QUERY_LENGTH && !memcmp(capQuery, diagQuery, DIAG_QUERY_LENGTH)) {
+			captureQueryDone("diagnostic");
+			capturePending(-1);
+			capStats.diag++;
+		}
+#endif
+		break;
+	case TRACE_MATCH:
+		snprintf(note, sizeof(note), "query %d", data);
+		captureQueryDone(note);
+		capStats.matched++;
+		if(data < tableLength && table[data].rLength)
+			capturePending(data);
+		break;
+	case TRACE_DROP:
+		captureQueryDone("unknown");
+		capStats.unknown++;
+		break;
+	case TRACE_TIMEOUT:
+		captureQueryDone("timeout");
+		capStats.timeout++;
+		break;
+	}
+}
+
+static void decodeCapture(const char *filename)
+{
+	struct stat st;
+	int fd = open(filename, O_RDONLY);
+	void *map;
+	clock_t started = clock();
+	double seconds;
+
+	if(fd < 0 || fstat(fd, &st) < 0) {
+		perror(filename);
+		exit(1);
+	}
+	map = st.st_size ? mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	if(map == MAP_FAILED) {
+		fprintf(stderr, "%s: cannot map\n", filename);
+		exit(1);
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	capture.p = map;
+	capture.end = capture.p + st.st_size;
+	capture.size = st.st_size;
+	capture.csv = strlen(filename) > 4 && !strcasecmp(filename + strlen(filename) - 4, ".csv");
+	if(capture.csv) {
+		captureHeaderCsv();
+		if(capture.rxColumn < 0) {
+			fprintf(stderr, "%s: no RX column\n", filename);
+			exit(1);
+		}
+	} else {
+		captureHeaderVcd();
+		if(!capture.rxId[0]) {
+			fprintf(stderr, "%s: no RX signal\n", filename);
+			exit(1);
+		}
+	}
+
+	// Ushio straps as in the scenarios, ID0 low for Osram (-o). With
+	// AUTO_SERIAL the mode is detected from RX instead
+	simPins = simLastPins = PINB = RXPIN | SYNCPIN | ID1 | (captureOsram ? 0 : ID0);
+	OSCCAL = SIM_OSCCAL;
+	memset(simEeprom, 0xFF, sizeof(simEeprom));
+	if(eepromFile)
+		readEeprom(eepromFile);
+	txRecord = 0;
+	waveAdd(&rxWave, 0, 1);
+	waveAdd(&capTx, 0, 1);
+	simEnd = 1e18;
+	captureParse();
+	rxRefill = captureRefill;
+	simTraceHook = captureTrace;
+	simWaitHook = captureWait;
+
+	printf("%12s %c  %-24s %s\n", "time ms", ' ', "bytes (! = error)", "");
+	if(!setjmp(simExit))
+		firmwareMain();
+	captureReplies(1e18);
+	captureReplyDone();
+	if(capQueryLength)
+		captureQueryDone("incomplete");
+
+	seconds = (double)(clock() - started) / CLOCKS_PER_SEC;
+	printf("\n%s mode, queries: %d matched, %d unknown, %d timed out, %d diagnostic, %d bytes with errors\n",
+		operationMode == OSRAM ? "Osram" : "Ushio", capStats.matched, capStats.unknown, capStats.timeout,
+		capStats.diag, capStats.errors);
+	printf("Replies: %d as expected, %d different, %d missing, %d unexpected",
+		capStats.ok, capStats.differs, capStats.missing, capStats.unexpected);
+	if(capStats.ok + capStats.differs)
+		printf(", latency %.3f / %.3f / %.3f ms min/avg/max", capStats.latencyMin / 1000,
+			capStats.latencySum / (capStats.ok + capStats.differs) / 1000, capStats.latencyMax / 1000);
+	printf("\nDecoded %.1f s of capture in %.2f s\n", capture.time / 1e6, seconds);
+}
+
+int main(int argc, char **argv)
+{
+	const char *tableFile = "ushio-queries.txt";
+	const char *captureFile = 0;
+	int queries = 200;
+	uint32_t seed = 1;
+	unsigned int i;
+	int n, status, failed = 0;
+	pid_t pid;
+
+	for(n = 1; n < argc; n++) {
+		if(!strcmp(argv[n], "-n") && n + 1 < argc)
+			queries = atoi(argv[++n]);
+		else if(!strcmp(argv[n], "-s") && n + 1 < argc)
+			seed = strtoul(argv[++n], 0, 0);
+		else if(!strcmp(argv[n], "-t") && n + 1 < argc)
+			tableFile = argv[++n];
+		else if(!strcmp(argv[n], "-e") && n + 1 < argc)
+			eepromFile = argv[++n];
+		else if(!strcmp(argv[n], "-c") && n + 1 < argc)
+			captureFile = argv[++n];
+		else if(!strcmp(argv[n], "-o"))
+			captureOsram = 1;
+		else if(!strcmp(argv[n], "-R") && n + 1 < argc)
+			captureRx = argv[++n];
+		else if(!strcmp(argv[n], "-T") && n + 1 < argc)
+			captureTx = argv[++n];
+		else if(!strcmp(argv[n], "-F") && n + 1 < argc)
+			captureRate = strtod(argv[++n], 0);
+		else
+			usage(argv[0]);
+	}
+
+	readTable(tableFile);
+	if(!tableLength) {
+		fprintf(stderr, "%s: no queries\n", tableFile);
+		return 1;
+	}
+	if(captureFile) {
+		decodeCapture(captureFile);
+		return 0;
+	}
+
+	printf("Tick %d us, %d queries per scenario, OSCCAL in steps of %.1f %% from factory value\n\n",
+		TICK_COUNTS(USHIO_BAUD, USHIO_TICKS), queries, 100 * SIM_OSCCAL_STEP);
+	printf("%-16s %6s %8s %26s %7s %6s %7s %3s", "scenario", "sent", "ok", "latency, ticks min/avg/max", "OSCCAL", "mode",
+		"boot us", "1st");
+#ifdef COUNTERS
+	printf(" %5s %5s %5s", "rxerr", "unkn", "tmout");
+#endif
+#ifdef LEARN
+	printf(" %5s %5s %6s", "learn", "hits", "writes");
+#endif
+	printf("\n");
+	fflush(stdout);
+
+	// Firmware state lives in globals, so each scenario gets a new process
+	for(i = 0; i < SCENARIOS; i++) {
+		pid = fork();
+		if(pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		if(!pid) {
+			randomState = (seed + i) | 1;
+			runScenario(i, queries);
+			fflush(stdout);
+			_exit(0);
+		}
+		if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "Scenario %s failed\n", scenarios[i].name);
+			failed = 1;
+		}
+	}
+
+	return failed;
+}
@@ -0,0 +1,13 @@
+/**
+ * Host simulation stand-in for <util/atomic.h>
+ * Interrupts only run between simulation steps, so the block needs no
+ * locking and runs its body once
+ */
+#ifndef SIM_UTIL_ATOMIC_H
+#define SIM_UTIL_ATOMIC_H
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+#define ATOMIC_BLOCK(type)	for(int simAtomic = 1; simAtomic; simAtomic = 0)
+
+#endif
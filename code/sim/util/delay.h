@@ -0,0 +1,12 @@
+/**
+ * Host simulation stand-in for <util/delay.h>
+ * Delays advance the simulation time
+ */
+#ifndef SIM_UTIL_DELAY_H
+#define SIM_UTIL_DELAY_H
+
+void simDelay(unsigned long us);
+#define _delay_us(us)		simDelay(us)
+#define _delay_ms(ms)		simDelay((ms) * 1000UL)
+
+#endif
@@ -0,0 +1,55 @@
+// Generated by gen-queries.py from ushio-queries.txt, do not edit
+
+#define USHIO_QUERIES		4	// Number of distinct queries
+#define USHIO_MAX_QUERY		3	// Longest query
+#define USHIO_MATCHER_SIZE	38	// Bytes in matcher table
+#define USHIO_REPLY_SIZE	10	// Frames in reply table
+#define USHIO_TERMINATOR	0x0D	// Last byte of every query
+
+// Matcher states: matched query, number of transitions, {received byte, next state}
+#define USHIO_MATCHER_DATA { \
+	MATCH_NO_QUERY, 3, 0x4C, 8, 0x50, 14, 0x51, 18,	/* 0 */ \
+	MATCH_NO_QUERY, 2, 0x45, 22, 0x46, 26,	/* 8 */ \
+	MATCH_NO_QUERY, 1, 0x0D, 30,	/* 14 */ \
+	MATCH_NO_QUERY, 1, 0x0D, 32,	/* 18 */ \
+	MATCH_NO_QUERY, 1, 0x0D, 34,	/* 22 */ \
+	MATCH_NO_QUERY, 1, 0x0D, 36,	/* 26 */ \
+	2, 0,	/* 30 */ \
+	0, 0,	/* 32 */ \
+	3, 0,	/* 34 */ \
+	1, 0,	/* 36 */ \
+	}
+
+// Next state after the first byte of a query, 0xFF = MATCH_DISCARD
+#define USHIO_DISPATCH_DATA { \
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,	/* 0x00 */ \
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,	/* 0x10 */ \
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,	/* 0x20 */ \
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,	/* 0x30 */ \
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x08, 0xFF, 0xFF, 0xFF,	/* 0x40 */ \
+	0x0E, 0x12, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,	/* 0x50 */ \
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,	/* 0x60 */ \
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,	/* 0x70 */ \
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,	/* 0x80 */ \
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,	/* 0x90 */ \
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,	/* 0xA0 */ \
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,	/* 0xB0 */ \
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,	/* 0xC0 */ \
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,	/* 0xD0 */ \
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,	/* 0xE0 */ \
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,	/* 0xF0 */ \
+	}
+
+// Replies as 11-bit serial frames, shifted out LSB first
+#define USHIO_REPLY_DATA { \
+	0x6A2, 0x664, 0x61A,	/* 0x51 0x0D -> 0x51 0x32 0x0D */ \
+	0x482, 0x61A,	/* 0x4C 0x46 0x0D -> 0x41 0x0D */ \
+	0x4A0, 0x68C, 0x61A,	/* 0x50 0x0D -> 0x50 0x46 0x0D */ \
+	0x482, 0x61A,	/* 0x4C 0x45 0x0D -> 0x41 0x0D */ \
+	}
+
+// Start of each reply in reply data, reply n ends where n + 1 starts
+#define USHIO_REPLY_INDEX {0, 3, 5, 8, 10}
+
+// Reply delay of each query in 1/4 bits, last entry only pads an empty table
+#define USHIO_REPLY_DELAY {0, 0, 0, 0, 0}